@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "da.h"
+#include "irc.h"
+
+#define ARRLEN(xs) (sizeof(xs) / sizeof(*(xs)))
+
+// Headless parser benchmark, see `make bench`. Replays recorded server
+// traffic through irc_replay and reports throughput, allocations and memory.
+//
+//     toki-bench <file|->...            replay each file, - is stdin
+//     toki-bench generate <corpus> [n]  write a synthetic corpus to stdout
+
+IrcConnections connections = {0};
+int current_connection = -1;
+int current_channel = -1;
+
+static size_t allocations = 0;
+
+#ifdef __linux__
+// The bench is linked with -Wl,--wrap for these, so every allocation made by
+// the toki objects is counted. Other platforms report 0.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+#define NICK "toki"
+#define SERVER ":irc.bench "
+
+static uint64_t random_state = 0x9E3779B97F4A7C15;
+
+// xorshift64, the corpora have to be the same on every run
+static uint32_t random_below(uint32_t n) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state % n;
+}
+
+static const char *words[] = {
+    "the", "build", "is", "green", "again", "did", "anyone", "try", "new",
+    "release", "on", "arm64", "patch", "looks", "fine", "to", "me", "but",
+    "tests", "are", "flaky", "lol", "ok", "merged", "thanks", "kernel",
+    "panic", "after", "upgrade", "works", "for", "with", "wayland", "x11",
+    "ping", "pong", "afk", "back", "brb", "https://example.org/issue/4217",
+};
+
+static void random_text(FILE *out, int min_words, int max_words) {
+    int n = min_words + random_below(max_words - min_words + 1);
+    for (int i = 0; i < n; i++)
+        fprintf(out, "%s%s", i > 0 ? " " : "", words[random_below(ARRLEN(words))]);
+}
+
+static void random_nick(FILE *out, uint32_t id) {
+    static const char *stems[] = {"alice", "bob", "carol", "dave", "eve", "mallory", "trent", "peggy", "victor", "walter"};
+    fprintf(out, "%s%u", stems[id % ARRLEN(stems)], id);
+}
+
+static void registration(FILE *out) {
+    fprintf(out, SERVER "001 " NICK " :Welcome to the bench network " NICK "\r\n");
+    fprintf(out, SERVER "005 " NICK " CASEMAPPING=rfc1459 CHANTYPES=# PREFIX=(qaohv)~&@%%+ :are supported by this server\r\n");
+    fprintf(out, SERVER "376 " NICK " :End of /MOTD command.\r\n");
+}
+
+static void self_join(FILE *out, const char *channel) {
+    fprintf(out, ":" NICK "!toki@bench JOIN %s\r\n", channel);
+}
+
+// One RPL_LIST per channel of a big network
+static void generate_list(FILE *out, size_t n) {
+    registration(out);
+    fprintf(out, SERVER "321 " NICK " Channel :Users  Name\r\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, SERVER "322 " NICK " #channel%zu %u :", i, 1 + random_below(random_below(8) == 0 ? 5000 : 40));
+        random_text(out, 0, 12);
+        fprintf(out, "\r\n");
+    }
+    fprintf(out, SERVER "323 " NICK " :End of /LIST\r\n");
+}
+
+// A busy channel, some messages carry a server-time tag
+static void generate_privmsg(FILE *out, size_t n) {
+    registration(out);
+    self_join(out, "#busy");
+    for (size_t i = 0; i < n; i++) {
+        if (random_below(4) == 0)
+            fprintf(out, "@time=2024-05-%02uT%02u:%02u:%02u.%03uZ ", 1 + random_below(28), random_below(24),
+                    random_below(60), random_below(60), random_below(1000));
+        fprintf(out, ":");
+        uint32_t sender = random_below(800);
+        random_nick(out, sender);
+        fprintf(out, "!user%u@host%u.example.org PRIVMSG #busy :", sender, sender % 97);
+        random_text(out, 1, 30);
+        fprintf(out, "\r\n");
+    }
+}
+
+// NAMES of a few big channels, as sent right after joining them
+static void generate_names(FILE *out, size_t n) {
+    static const char prefixes[] = "~&@%+";
+    registration(out);
+    const char *channels[] = {"#huge", "#large", "#medium"};
+    for (size_t c = 0; c < ARRLEN(channels); c++)
+        self_join(out, channels[c]);
+    for (size_t c = 0; c < ARRLEN(channels); c++) {
+        size_t nicks = n >> c;
+        for (size_t i = 0; i < nicks;) {
+            fprintf(out, SERVER "353 " NICK " = %s :", channels[c]);
+            for (size_t j = 0; j < 40 && i < nicks; j++, i++) {
+                if (j > 0)
+                    fprintf(out, " ");
+                if (random_below(10) == 0)
+                    fprintf(out, "%c", prefixes[random_below(sizeof(prefixes) - 1)]);
+                random_nick(out, i);
+            }
+            fprintf(out, "\r\n");
+        }
+        fprintf(out, SERVER "366 " NICK " %s :End of /NAMES list.\r\n", channels[c]);
+    }
+}
+
+// Half of the users of several channels split off and come back
+static void generate_netsplit(FILE *out, size_t n) {
+    registration(out);
+    const char *channels[] = {"#one", "#two", "#three", "#four"};
+    for (size_t c = 0; c < ARRLEN(channels); c++) {
+        self_join(out, channels[c]);
+        for (size_t i = 0; i < n; i += 40) {
+            fprintf(out, SERVER "353 " NICK " = %s :", channels[c]);
+            for (size_t j = i; j < i + 40 && j < n; j++) {
+                fprintf(out, "%s", j > i ? " " : "");
+                random_nick(out, j);
+            }
+            fprintf(out, "\r\n");
+        }
+        fprintf(out, SERVER "366 " NICK " %s :End of /NAMES list.\r\n", channels[c]);
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        fprintf(out, ":");
+        random_nick(out, i);
+        fprintf(out, "!u@split.example.org QUIT :*.example.org hub.example.org\r\n");
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        for (size_t c = 0; c < ARRLEN(channels); c++) {
+            fprintf(out, ":");
+            random_nick(out, i);
+            fprintf(out, "!u@split.example.org JOIN %s\r\n", channels[c]);
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*generate)(FILE *out, size_t n);
+    size_t n;
+} corpora[] = {
+    {"list", generate_list, 200000},
+    {"privmsg", generate_privmsg, 500000},
+    {"names", generate_names, 50000},
+    {"netsplit", generate_netsplit, 20000},
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double peak_rss_mib(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+static bool replay(const char *path) {
+    int fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    IrcConnection *conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL);
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    da_append_many(conn->server, "bench-", 6);
+    da_append_many(conn->server, name, strlen(name));
+    da_append_many(conn->nick, NICK, strlen(NICK));
+    conn->connected = true;
+    da_append(connections, conn);
+
+    IrcReplayStats stats;
+    size_t allocations_before = allocations;
+    double start = now_seconds();
+    irc_replay(conn, fd, &stats);
+    double seconds = now_seconds() - start;
+    size_t allocated = allocations - allocations_before;
+
+    printf("%-12s %9zu lines %8.1f MiB %7.3f s %10.0f lines/s %8.1f MiB/s %6.2f allocs/line %8.1f MiB peak RSS\n",
+           name, stats.lines, stats.bytes / (1024.0 * 1024.0), seconds,
+           stats.lines / seconds, stats.bytes / (1024.0 * 1024.0) / seconds,
+           stats.lines > 0 ? (double)allocated / stats.lines : 0.0, peak_rss_mib());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "generate") == 0) {
+        for (size_t i = 0; i < ARRLEN(corpora); i++) {
+            if (strcmp(argv[2], corpora[i].name) != 0)
+                continue;
+            size_t n = argc >= 4 ? strtoul(argv[3], NULL, 10) : corpora[i].n;
+            corpora[i].generate(stdout, n);
+            return fflush(stdout) == 0 ? 0 : 1;
+        }
+        fprintf(stderr, "unknown corpus %s\n", argv[2]);
+        return 1;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file|->...\n       %s generate <list|privmsg|names|netsplit> [n]\n", argv[0], argv[0]);
+        return 1;
+    }
+    bool ok = true;
+    for (int i = 1; i < argc; i++)
+        ok = replay(argv[i]) && ok;
+    irc_destroy();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Channels are allocated in chunks that never move, so Channel pointers stay
+// valid for as long as the table lives
+#define CHANNEL_CHUNK 256
+
+char casefold(CaseMapping mapping, char c) {
+    if ('A' <= c && c <= 'Z')
+        return c - 'A' + 'a';
+    switch (mapping) {
+    case CASEMAPPING_ASCII:
+        break;
+    case CASEMAPPING_RFC1459:
+        // {}|~ are the lowercase versions of []\^
+        if (c == '^')
+            return '~';
+        // fallthrough
+    case CASEMAPPING_STRICT_RFC1459:
+        if (c == '[')
+            return '{';
+        if (c == ']')
+            return '}';
+        if (c == '\\')
+            return '|';
+        break;
+    }
+    return c;
+}
+
+bool casefold_equal(CaseMapping mapping, StringView a, StringView b) {
+    if (a.len != b.len)
+        return false;
+    for (size_t i = 0; i < a.len; i++) {
+        if (casefold(mapping, a.data[i]) != casefold(mapping, b.data[i]))
+            return false;
+    }
+    return true;
+}
+
+CaseMapping parse_casemapping(StringView value) {
+    if (value.len == 5 && memcmp(value.data, "ascii", 5) == 0)
+        return CASEMAPPING_ASCII;
+    if (value.len == 14 && memcmp(value.data, "strict-rfc1459", 14) == 0)
+        return CASEMAPPING_STRICT_RFC1459;
+    return CASEMAPPING_RFC1459;
+}
+
+static uint32_t hash_name(CaseMapping mapping, StringView name) {
+    // FNV-1a over the folded name
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.len; i++) {
+        h ^= (unsigned char)casefold(mapping, name.data[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline StringView channel_name(const Channel *channel) {
+    return (StringView){.data = channel->name.data, .len = channel->name.len};
+}
+
+static void insert_slot(Channels *channels, uint32_t index) {
+    size_t mask = channels->slot_count - 1;
+    size_t i = hash_name(channels->casemapping, channel_name(channels->data[index])) & mask;
+    while (channels->slots[i] != 0)
+        i = (i + 1) & mask;
+    channels->slots[i] = index + 1;
+}
+
+static void rehash(Channels *channels, size_t slot_count) {
+    free(channels->slots);
+    channels->slot_count = slot_count;
+    channels->slots = calloc(slot_count, sizeof(*channels->slots));
+    assert(channels->slots != NULL);
+    for (size_t i = 0; i < channels->len; i++)
+        insert_slot(channels, i);
+}
+
+void channels_set_casemapping(Channels *channels, CaseMapping mapping) {
+    if (channels->casemapping == mapping)
+        return;
+    channels->casemapping = mapping;
+    if (channels->slot_count > 0)
+        rehash(channels, channels->slot_count);
+}
+
+Channel *channels_find(Channels *channels, StringView name) {
+    if (channels->slot_count == 0)
+        return NULL;
+    size_t mask = channels->slot_count - 1;
+    for (size_t i = hash_name(channels->casemapping, name) & mask; channels->slots[i] != 0; i = (i + 1) & mask) {
+        Channel *channel = channels->data[channels->slots[i] - 1];
+        if (casefold_equal(channels->casemapping, channel_name(channel), name))
+            return channel;
+    }
+    return NULL;
+}
+
+Channel *channels_add(Channels *channels, StringView name) {
+    Channel *channel = channels_find(channels, name);
+    if (channel != NULL)
+        return channel;
+    if (channels->len % CHANNEL_CHUNK == 0) {
+        Channel *chunk = calloc(CHANNEL_CHUNK, sizeof(Channel));
+        assert(chunk != NULL);
+        da_append(channels->chunks, chunk);
+    }
+    channel = &da_last(channels->chunks)[channels->len % CHANNEL_CHUNK];
+    da_reserve(channel->name, name.len + 1);
+    memcpy(channel->name.data, name.data, name.len);
+    channel->name.data[name.len] = '\0';
+    channel->name.len = name.len;
+    da_append(*channels, channel);
+    channel->sidebar_index = channels->sidebar.len;
+    da_append(channels->sidebar, channel);
+    // keep the load factor under 1/2
+    if (2 * channels->len > channels->slot_count)
+        rehash(channels, channels->slot_count == 0 ? 64 : channels->slot_count * 2);
+    else
+        insert_slot(channels, channels->len - 1);
+    return channel;
+}
+
+// Only the entries between the old and the new position shift by one
+static void sidebar_move(Channels *channels, Channel *channel, size_t to) {
+    Channel **order = channels->sidebar.data;
+    size_t from = channel->sidebar_index;
+    if (from > to) {
+        memmove(order + to + 1, order + to, (from - to) * sizeof(*order));
+        for (size_t i = to + 1; i <= from; i++)
+            order[i]->sidebar_index = i;
+    } else if (from < to) {
+        memmove(order + from, order + from + 1, (to - from) * sizeof(*order));
+        for (size_t i = from; i < to; i++)
+            order[i]->sidebar_index = i;
+    }
+    order[to] = channel;
+    channel->sidebar_index = to;
+}
+
+void channels_set_joined(Channels *channels, Channel *channel, bool joined) {
+    if (channel->joined == joined)
+        return;
+    channel->joined = joined;
+    if (joined) {
+        sidebar_move(channels, channel, 0);
+        channels->sidebar_joined++;
+    } else {
+        // first of the channels that are not joined
+        sidebar_move(channels, channel, channels->sidebar_joined - 1);
+        channels->sidebar_joined--;
+    }
+}
+
+void channels_touch(Channels *channels, Channel *channel) {
+    if (channel->joined && channel->sidebar_index != 0)
+        sidebar_move(channels, channel, 0);
+}
+
+void channels_free(Channels *channels) {
+    for (size_t i = 0; i < channels->len; i++) {
+        Channel *channel = channels->data[i];
+        free_messages(&channel->messages);
+        log_close(&channel->log);
+        free(channel->members.data);
+        free(channel->names_pending.data);
+        for (size_t j = 0; j < channel->backlog.len; j++)
+            free(channel->backlog.data[j]);
+        free(channel->backlog.data);
+        for (size_t j = 0; j < channel->unechoed.len; j++)
+            free(channel->unechoed.data[j].data);
+        free(channel->unechoed.data);
+        free(channel->name.data);
+        free(channel->topic.data);
+    }
+    for (size_t i = 0; i < channels->chunks.len; i++)
+        free(channels->chunks.data[i]);
+    free(channels->chunks.data);
+    free(channels->data);
+    free(channels->sidebar.data);
+    free(channels->slots);
+    *channels = (Channels){0};
+}
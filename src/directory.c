@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "da.h"
+#include "irc.h"
+
+static uint32_t add_string(ChannelDirectory *dir, StringView sv) {
+    uint32_t offset = dir->chars.len;
+    da_reserve(dir->chars, sv.len + 1);
+    memcpy(dir->chars.data + dir->chars.len, sv.data, sv.len);
+    dir->chars.len += sv.len;
+    dir->chars.data[dir->chars.len++] = '\0';
+    return offset;
+}
+
+void directory_add(ChannelDirectory *dir, StringView name, uint32_t users, StringView topic) {
+    da_append(dir->names, add_string(dir, name));
+    da_append(dir->topics, add_string(dir, topic));
+    da_append(dir->users, users);
+    dir->dirty = true;
+}
+
+void directory_clear(ChannelDirectory *dir) {
+    dir->chars.len = dir->names.len = dir->topics.len = dir->users.len = 0;
+    dir->complete = false;
+    dir->dirty = true;
+}
+
+void directory_append(ChannelDirectory *dir, const ChannelDirectory *batch) {
+    // a new LIST replaces the last complete one
+    if (dir->complete)
+        directory_clear(dir);
+    uint32_t base = dir->chars.len;
+    da_append_many(dir->chars, batch->chars.data, batch->chars.len);
+    da_reserve(dir->names, batch->names.len);
+    da_reserve(dir->topics, batch->topics.len);
+    for (size_t i = 0; i < batch->names.len; i++) {
+        dir->names.data[dir->names.len++] = base + batch->names.data[i];
+        dir->topics.data[dir->topics.len++] = base + batch->topics.data[i];
+    }
+    da_append_many(dir->users, batch->users.data, batch->users.len);
+    dir->complete = batch->complete;
+    dir->dirty = true;
+}
+
+static inline StringView string_at(const ChannelDirectory *dir, uint32_t offset) {
+    const char *data = dir->chars.data + offset;
+    return (StringView){.data = data, .len = strlen(data)};
+}
+
+StringView directory_name(const ChannelDirectory *dir, size_t i) {
+    return string_at(dir, dir->names.data[i]);
+}
+
+StringView directory_topic(const ChannelDirectory *dir, size_t i) {
+    return string_at(dir, dir->topics.data[i]);
+}
+
+// qsort has no context argument, the UI thread is the only one sorting
+static const ChannelDirectory *sorting;
+
+static int compare_names(const void *a, const void *b) {
+    const char *na = sorting->chars.data + sorting->names.data[*(const uint32_t *)a];
+    const char *nb = sorting->chars.data + sorting->names.data[*(const uint32_t *)b];
+    return strcmp(na, nb);
+}
+
+static int compare_users(const void *a, const void *b) {
+    uint32_t ua = sorting->users.data[*(const uint32_t *)a];
+    uint32_t ub = sorting->users.data[*(const uint32_t *)b];
+    // most users first
+    if (ua != ub)
+        return ua < ub ? 1 : -1;
+    return compare_names(a, b);
+}
+
+void directory_update_view(ChannelDirectory *dir) {
+    if (!dir->dirty)
+        return;
+    dir->view.len = 0;
+    for (uint32_t i = 0; i < dir->names.len; i++) {
+        if (dir->users.data[i] >= dir->min_users)
+            da_append(dir->view, i);
+    }
+    sorting = dir;
+    qsort(dir->view.data, dir->view.len, sizeof(*dir->view.data),
+          dir->sort == DIRECTORY_SORT_NAME ? compare_names : compare_users);
+    sorting = NULL;
+    dir->dirty = false;
+}
+
+void directory_free(ChannelDirectory *dir) {
+    free(dir->chars.data);
+    free(dir->names.data);
+    free(dir->topics.data);
+    free(dir->users.data);
+    free(dir->view.data);
+    *dir = (ChannelDirectory){0};
+}
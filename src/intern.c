@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "da.h"
+#include "irc.h"
+
+static uint32_t hash_sv(StringView sv) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sv.len; i++) {
+        h ^= (unsigned char)sv.data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void add_string(Interner *in, StringView sv) {
+    da_append(in->offsets, in->chars.len);
+    da_reserve(in->chars, sv.len + 1);
+    memcpy(in->chars.data + in->chars.len, sv.data, sv.len);
+    in->chars.len += sv.len;
+    in->chars.data[in->chars.len++] = '\0';
+}
+
+static void insert_slot(Interner *in, uint32_t id) {
+    size_t mask = in->slot_count - 1;
+    size_t i = hash_sv(interned(in, id)) & mask;
+    while (in->slots[i] != 0)
+        i = (i + 1) & mask;
+    in->slots[i] = id + 1;
+}
+
+static void grow_slots(Interner *in) {
+    free(in->slots);
+    in->slot_count = in->slot_count == 0 ? 64 : in->slot_count * 2;
+    in->slots = calloc(in->slot_count, sizeof(*in->slots));
+    assert(in->slots != NULL);
+    // id 0 is the empty string and never looked up
+    for (uint32_t id = 1; id < in->offsets.len; id++)
+        insert_slot(in, id);
+}
+
+uint32_t intern(Interner *in, StringView sv) {
+    if (in->offsets.len == 0)
+        add_string(in, (StringView){.data = "", .len = 0});
+    if (sv.len == 0)
+        return 0;
+    // keep the load factor under 1/2
+    if (2 * in->offsets.len >= in->slot_count)
+        grow_slots(in);
+    size_t mask = in->slot_count - 1;
+    for (size_t i = hash_sv(sv) & mask; in->slots[i] != 0; i = (i + 1) & mask) {
+        StringView other = interned(in, in->slots[i] - 1);
+        if (other.len == sv.len && memcmp(other.data, sv.data, sv.len) == 0)
+            return in->slots[i] - 1;
+    }
+    uint32_t id = in->offsets.len;
+    add_string(in, sv);
+    insert_slot(in, id);
+    return id;
+}
+
+StringView interned(const Interner *in, uint32_t id) {
+    if (id >= in->offsets.len)
+        return (StringView){.data = "", .len = 0};
+    size_t start = in->offsets.data[id];
+    size_t end = id + 1 < in->offsets.len ? in->offsets.data[id + 1] : in->chars.len;
+    return (StringView){.data = in->chars.data + start, .len = end - start - 1};
+}
+
+void free_interner(Interner *in) {
+    free(in->chars.data);
+    free(in->offsets.data);
+    free(in->slots);
+    *in = (Interner){0};
+}
@@ -8,9 +8,22 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
 
 #include "da.h"
 #include "irc.h"
+#include "spsc.h"
 
 #define TODO(str)                                                              \
     do {                                                                       \
@@ -19,34 +32,352 @@
     } while (false)
 
 typedef enum {
-    RPL_WELCOME        =   1,
-    RPL_YOURHOST       =   2,
-    RPL_CREATED        =   3,
-    RPL_MYINFO         =   4,
-    RPL_ISUPPORT       =   5,
-    RPL_LUSERCLIENT    = 251,
-    RPL_LUSERCHANNELS  = 254,
-    RPL_LUSERME        = 255,
-    RPL_LOCALUSERS     = 265,
-    RPL_NETUSERS       = 266,
-    RPL_STATSCONN      = 250,
-    RPL_LISTSTART      = 321,
-    RPL_LIST           = 322,
-    RPL_LISTEND        = 323,
-    RPL_TOPIC          = 332,
-    RPL_TOPICSETBY     = 333,
-    RPL_NAMREPLY       = 353,
-    RPL_ENDOFNAMES     = 366,
-    ERR_NOMOTD         = 422,
+    RPL_WELCOME         =   1,
+    RPL_YOURHOST        =   2,
+    RPL_CREATED         =   3,
+    RPL_MYINFO          =   4,
+    RPL_ISUPPORT        =   5,
+    RPL_LUSERCLIENT     = 251,
+    RPL_LUSERCHANNELS   = 254,
+    RPL_LUSERME         = 255,
+    RPL_LOCALUSERS      = 265,
+    RPL_NETUSERS        = 266,
+    RPL_STATSCONN       = 250,
+    RPL_LISTSTART       = 321,
+    RPL_LIST            = 322,
+    RPL_LISTEND         = 323,
+    RPL_TOPIC           = 332,
+    RPL_TOPICSETBY      = 333,
+    RPL_NAMREPLY        = 353,
+    RPL_ENDOFNAMES      = 366,
+    RPL_ENDOFMOTD       = 376,
+    ERR_NOSUCHCHANNEL   = 403,
+    ERR_TOOMANYCHANNELS = 405,
+    ERR_NOMOTD          = 422,
+    ERR_CHANNELISFULL   = 471,
+    ERR_INVITEONLYCHAN  = 473,
+    ERR_BANNEDFROMCHAN  = 474,
+    ERR_BADCHANNELKEY   = 475,
 } IrcReply;
 
-// might be a good idea to just pass it as an argument
-extern int server_fd;
+// A single network thread multiplexes the sockets of all connections with
+// poll. It parses lines and hands the results over to the UI thread as
+// events, see irc_proccess. The UI thread is the only one that touches the
+// IrcConnection objects and `current_connection`/`current_channel`, so none of
+// them need locking.
+
+typedef enum {
+    IRC_EVENT_MESSAGE,
+    IRC_EVENT_TOPIC,
+    IRC_EVENT_JOIN,
+    // the server refused our JOIN, the reason is in message
+    IRC_EVENT_JOIN_FAILED,
+    // a batch of RPL_LIST entries in `directory`
+    IRC_EVENT_LIST,
+    // space separated nicks of one RPL_NAMREPLY in text
+    IRC_EVENT_NAMES,
+    IRC_EVENT_END_OF_NAMES,
+    IRC_EVENT_PART,
+    IRC_EVENT_QUIT,
+    // the new nick is in text
+    IRC_EVENT_NICK,
+    // one KEY=value token of RPL_ISUPPORT, in target and text
+    IRC_EVENT_ISUPPORT,
+    // the capabilities of a CAP ACK in text
+    IRC_EVENT_CAPS,
+    // a whole chathistory batch in `history`
+    IRC_EVENT_HISTORY,
+    // how far connecting got, in text. Empty once registration is done.
+    IRC_EVENT_STATUS,
+    // registration is done and ISUPPORT is known, time to rejoin channels
+    IRC_EVENT_REGISTERED,
+    IRC_EVENT_DISCONNECTED,
+    // round trip of our lag PING in milliseconds, in text
+    IRC_EVENT_LAG,
+} IrcEventKind;
+
+// A line of a chathistory batch, the sender is interned by the UI thread
+typedef struct {
+    Message *message;
+    StringBuilder sender;
+} HistoryLine;
+
+typedef struct {
+    HistoryLine *data;
+    size_t len, cap;
+} History;
+
+typedef struct {
+    IrcEventKind kind;
+    IrcConnection *conn;
+    // channel the event is about, empty means the current channel (or the
+    // system messages if there is none)
+    StringBuilder target;
+    // nickname, interned by the UI thread into Message.sender
+    StringBuilder sender;
+    StringBuilder text;
+    // for IRC_EVENT_MESSAGE and IRC_EVENT_JOIN, built on the network thread
+    Message *message;
+    ChannelDirectory *directory;
+    History *history;
+} IrcEvent;
+
+typedef enum {
+    // hands a freshly connected socket over to the network thread
+    IRC_COMMAND_CONNECT,
+    // target may be a comma separated list of any length
+    IRC_COMMAND_JOIN,
+    IRC_COMMAND_PRIVMSG,
+    // CHATHISTORY BEFORE target, the rest of the parameters are in text
+    IRC_COMMAND_CHATHISTORY,
+} IrcCommandKind;
 
+typedef struct {
+    IrcCommandKind kind;
+    IrcSocket *socket;
+    StringBuilder target;
+    StringBuilder text;
+} IrcCommand;
+
+// network thread -> UI thread
+static struct {
+    IrcEvent data[8192];
+    atomic_size_t head, tail;
+} events;
+
+// UI thread -> network thread
 static struct {
-    char *data;
-    size_t len, cap, pos;
-} lex;
+    IrcCommand data[256];
+    atomic_size_t head, tail;
+} commands;
+
+// network thread only
+static struct {
+    IrcSocket **data;
+    size_t len, cap;
+} sockets;
+
+static pthread_t network_thread;
+// lines parsed over all sockets, see irc_lines_parsed
+static atomic_size_t lines_parsed = 0;
+static atomic_bool network_running = false;
+// written by the UI thread to wake the network thread up from poll
+static int wake_fds[2] = {-1, -1};
+// the other way around, see irc_set_wakeup. Set once the UI was told about
+// new events, irc_proccess clears it before it drains the queue.
+static void (*wake_ui)(void) = NULL;
+static atomic_bool ui_woken = false;
+
+#define SB(s) (StringBuilder){.data = (s), .len = sizeof(s)-1}
+#define ARRLEN(xs) (sizeof(xs) / sizeof(*(xs)))
+
+#define IRC_READ_BUFFER_SIZE (64 * 1024)
+#define IRC_MAX_PARAMS 15
+// Room in the event queue a line needs before it is parsed. A line pushes at
+// most one event per parameter, multi-target PARTs wait for room beyond that.
+#define IRC_LINE_EVENTS IRC_MAX_PARAMS
+
+typedef struct {
+    // message tags without the leading '@', see line_tag
+    StringView tags;
+    StringView prefix;
+    StringView command;
+    StringView params[IRC_MAX_PARAMS];
+    size_t param_count;
+} IrcLine;
+
+#define IRC_LINE_MAX 512
+#define LIST_BATCH 256
+#define OUTBOUND_SIZE (64 * 1024)
+#define OUTBOUND_MAX_LINES 1024
+#define OUTBOUND_URGENT_SIZE (4 * IRC_LINE_MAX)
+// lines asked for per CHATHISTORY request, unless the server allows fewer
+#define CHATHISTORY_PAGE 100
+
+// Reconnect delays double from the first to the last, see socket_closed
+#define RECONNECT_FIRST_MS 1000
+#define RECONNECT_MAX_MS (5 * 60 * 1000)
+
+// once registered the server is pinged this often to measure the lag
+#define LAG_PING_INTERVAL_MS (30 * 1000)
+#define LAG_PING_TOKEN "toki-lag"
+
+// RFC 8305 "Connection Attempt Delay", the next address is tried when the
+// previous one did not answer within this time
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+// getaddrinfo blocks for as long as DNS takes, so it runs on a thread of its
+// own. Whichever of it and the socket is done with it last frees it.
+typedef struct {
+    pthread_mutex_t lock;
+    bool done;
+    bool abandoned;
+    char *host, *port;
+    struct addrinfo *addresses;
+    int error;
+} Resolver;
+
+typedef struct {
+    int fd;
+    const struct addrinfo *address;
+} ConnectAttempt;
+
+// A BATCH that was opened and not closed yet
+typedef struct {
+    StringBuilder id;
+    StringBuilder target;
+    // NULL unless it is a chathistory batch, the only type toki looks into
+    History *history;
+} Batch;
+
+// Network side of an IrcConnection, only ever touched by the network thread
+// once irc_connect has handed it over
+struct IrcSocket {
+    // only used to tag events, never dereferenced on the network thread
+    IrcConnection *conn;
+    int fd;
+    char *host, *port;
+    // to register again after reconnecting
+    char *nick;
+
+    // set while waiting for reconnect_at after the connection was lost
+    bool reconnecting;
+    struct timespec reconnect_at;
+    // since the last successful registration
+    int reconnects;
+    // RPL_ENDOFMOTD or ERR_NOMOTD was seen
+    bool registered;
+    // the JOIN the UI sends for IRC_EVENT_REGISTERED was queued, deferred
+    // PRIVMSGs go after it so their channels are joined again
+    bool rejoined;
+    // most channels per JOIN according to TARGMAX, 0 for no limit
+    size_t join_targmax;
+    // the next lag PING is due at lag_ping_at, unless one is still on its way
+    bool lag_ping_pending;
+    struct timespec lag_ping_at, lag_ping_sent;
+
+    // Set until one of the addresses of host accepted the connection, fd is
+    // -1 until then. See connect_step.
+    bool connecting;
+    Resolver *resolver;
+    struct addrinfo *addresses;
+    // addresses in the order they are tried
+    struct {
+        const struct addrinfo **data;
+        size_t len, cap;
+    } candidates;
+    size_t next_candidate;
+    // connects that are still in progress
+    struct {
+        ConnectAttempt *data;
+        size_t len, cap;
+    } attempts;
+    struct timespec connect_started, attempt_started;
+    // of the last attempt that failed
+    int connect_error;
+
+    // NULL for plaintext connections. Decrypted data is read straight into
+    // `lex` and the outbound ring is encrypted from where it is, so both go
+    // through the same buffers as plaintext.
+    SSL *tls;
+    bool tls_handshaking;
+    // OpenSSL has to wait for the socket to become writable
+    bool tls_wants_write;
+    // a record of ring data is encrypted but not sent, OpenSSL has to be
+    // called with that data again before anything else
+    bool tls_retry_ring;
+
+    // Socket data is read straight into this buffer in big chunks. Complete
+    // lines are parsed in place and only the unfinished tail is moved back to
+    // the start before the next read, so every line handed to the parser is
+    // contiguous.
+    struct {
+        char *data;
+        size_t len, cap, pos;
+        // set when a line did not fit into the whole buffer, the rest of it
+        // is dropped up to the next newline
+        bool overflow;
+        // totals over the lifetime of the socket
+        size_t bytes, lines;
+    } lex;
+
+    // Outgoing lines are formatted straight into this ring and written out
+    // with writev once the socket is writable. Lines in [head, charged) have
+    // been paid for by the flood control and may be written, the ones in
+    // [charged, tail) wait for tokens. All offsets only ever grow.
+    struct {
+        char data[OUTBOUND_SIZE];
+        size_t head, charged, tail;
+        // lengths of the lines in [charged, tail)
+        uint16_t lines[OUTBOUND_MAX_LINES];
+        size_t line_head, line_tail;
+        size_t line_start;
+
+        // PING replies skip both the queue and the flood control
+        char urgent[OUTBOUND_URGENT_SIZE];
+        size_t urgent_head, urgent_len;
+
+        double tokens;
+        struct timespec refilled_at;
+    } outbound;
+
+    // RPL_LIST entries that were not handed over to the UI yet, they are sent
+    // in batches of LIST_BATCH
+    ChannelDirectory *list;
+
+    // space separated names of the capabilities from CAP LS we are going to
+    // request, and their IrcCap flags
+    StringBuilder wanted_caps;
+    uint32_t offered_caps;
+    struct {
+        Batch *data;
+        size_t len, cap;
+    } batches;
+    // PRIVMSGs that came in while the socket was not registered, they are
+    // sent in order once it is, see send_deferred
+    struct {
+        IrcCommand *data;
+        size_t len, cap;
+    } deferred;
+};
+
+static const struct {
+    const char *name;
+    IrcCap cap;
+} known_caps[] = {
+    {"message-tags", CAP_MESSAGE_TAGS},
+    {"server-time", CAP_SERVER_TIME},
+    {"batch", CAP_BATCH},
+    {"echo-message", CAP_ECHO_MESSAGE},
+    {"chathistory", CAP_CHATHISTORY},
+    {"draft/chathistory", CAP_CHATHISTORY},
+};
+
+static struct {
+    double lines_per_second;
+    double burst;
+} flood_control = {.lines_per_second = 1, .burst = 5};
+
+static struct {
+    bool enabled;
+    bool verify;
+    // extra CA certificates, the system ones are always trusted
+    const char *ca_file;
+} tls_config = {.enabled = true, .verify = true};
+
+static SSL_CTX *tls_ctx = NULL;
+
+// Sessions of every server we connected to, so connecting again can resume
+// them instead of doing a full handshake. Network thread only.
+typedef struct {
+    char *host, *port;
+    SSL_SESSION *session;
+} TlsSession;
+
+static struct {
+    TlsSession *data;
+    size_t len, cap;
+} tls_sessions = {0};
 
 static void free_string_builder(StringBuilder *sb) {
     // sb->cap = 0 means that it is either empty or statically allocated
@@ -56,438 +387,1999 @@ static void free_string_builder(StringBuilder *sb) {
     }
 }
 
-static void free_messages(Messages *msgs) {
-    for (size_t j = 0; j < msgs->len; j++) {
-        Message *msg = &msgs->data[j];
-        free_string_builder(&msg->sender);
-        free_string_builder(&msg->text);
-    }
-}
-
-static void free_channel(Channel *channel) {
-    free_messages(&channel->messages);
-    free_string_builder(&channel->name);
-    free_string_builder(&channel->topic);
-}
-
 static inline bool str_equal(StringBuilder s1, StringBuilder s2) {
     if (s1.len != s2.len)
         return false;
     return memcmp(s1.data, s2.data, s1.len) == 0;
 }
 
-static Channel *find_channel(StringBuilder name) {
-    for (size_t i = 0; i < channels.len; i++) {
-        if (str_equal(name, channels.data[i].name))
-            return &channels.data[i];
+static inline bool sv_equal(StringView sv, const char *cstr) {
+    size_t len = strlen(cstr);
+    return sv.len == len && memcmp(sv.data, cstr, len) == 0;
+}
+
+static inline StringBuilder sb_from_sv(StringView sv) {
+    StringBuilder sb = {0};
+    da_reserve(sb, sv.len + 1);
+    memcpy(sb.data, sv.data, sv.len);
+    sb.data[sv.len] = '\0';
+    sb.len = sv.len;
+    return sb;
+}
+
+static inline StringView sv_from_cstr(const char *cstr) {
+    return (StringView){.data = cstr, .len = strlen(cstr)};
+}
+
+static inline StringView sv_from_sb(StringBuilder sb) {
+    return (StringView){.data = sb.data, .len = sb.len};
+}
+
+static void disconnect(IrcSocket *s) {
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Maps the result of a failed SSL call to the conventions of read/write
+static ssize_t tls_error(IrcSocket *s, int ret) {
+    switch (SSL_get_error(s->tls, ret)) {
+    case SSL_ERROR_WANT_READ:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_WANT_WRITE:
+        s->tls_wants_write = true;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_print_errors_fp(stderr);
+        errno = EIO;
+        return -1;
     }
-    return NULL;
 }
 
-static void irc_listen(void) {
-    char buf[65535] = {0};
-    ssize_t len = read(server_fd, buf, sizeof(buf));
+static ssize_t transport_read(IrcSocket *s, char *buf, size_t len) {
+    if (s->tls == NULL)
+        return read(s->fd, buf, len);
+    s->tls_wants_write = false;
+    size_t n;
+    if (SSL_read_ex(s->tls, buf, len, &n))
+        return n;
+    return tls_error(s, 0);
+}
+
+// Sets *blocked to the index of the buffer OpenSSL got stuck on, or -1
+static ssize_t transport_writev(IrcSocket *s, const struct iovec *iov, int n, int *blocked) {
+    *blocked = -1;
+    if (s->tls == NULL)
+        return writev(s->fd, iov, n);
+    s->tls_wants_write = false;
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        size_t written;
+        if (!SSL_write_ex(s->tls, iov[i].iov_base, iov[i].iov_len, &written)) {
+            ssize_t ret = tls_error(s, 0);
+            if (ret < 0 && errno == EAGAIN)
+                *blocked = i;
+            return total > 0 ? (ssize_t)total : ret;
+        }
+        total += written;
+        // partial writes are enabled, the rest did not fit
+        if (written < iov[i].iov_len)
+            return total;
+    }
+    return total;
+}
+
+// Returns false if there is nothing more to read right now
+static bool irc_listen(IrcSocket *s) {
+    if (s->lex.data == NULL) {
+        s->lex.cap = IRC_READ_BUFFER_SIZE;
+        s->lex.data = malloc(s->lex.cap);
+        assert(s->lex.data != NULL);
+    }
+    // move the unfinished line to the front to make room for the next read
+    if (s->lex.pos > 0) {
+        memmove(s->lex.data, s->lex.data + s->lex.pos, s->lex.len - s->lex.pos);
+        s->lex.len -= s->lex.pos;
+        s->lex.pos = 0;
+    }
+    if (s->lex.len == s->lex.cap) {
+        // a single line is larger than the whole buffer, drop it
+        s->lex.len = 0;
+        s->lex.overflow = true;
+    }
+    ssize_t len = transport_read(s, s->lex.data + s->lex.len, s->lex.cap - s->lex.len);
     if (len == -1) {
-        if (errno == EAGAIN)
-            return;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return false;
         perror("irc_listen");
-        exit(1);
+        disconnect(s);
+        return false;
     }
     if (len == 0) {
-        close(server_fd);
-        server_fd = -1;
-        return;
+        disconnect(s);
+        return false;
     }
-    da_append_many(lex, buf, len);
-    if (len == sizeof(buf)) {
-        irc_listen();
+    s->lex.len += len;
+    s->lex.bytes += len;
+    return true;
+}
+
+// Finds the next complete line in the read buffer. The returned view points
+// into the buffer and stays valid until the next irc_listen call.
+static bool next_line(IrcSocket *s, StringView *line) {
+    while (s->lex.pos < s->lex.len) {
+        char *start = s->lex.data + s->lex.pos;
+        char *nl = memchr(start, '\n', s->lex.len - s->lex.pos);
+        if (nl == NULL)
+            return false;
+        s->lex.pos = nl - s->lex.data + 1;
+        if (s->lex.overflow) {
+            s->lex.overflow = false;
+            continue;
+        }
+        size_t len = nl - start;
+        if (len > 0 && start[len - 1] == '\r')
+            len--;
+        if (len == 0)
+            continue;
+        *line = (StringView){.data = start, .len = len};
+        s->lex.lines++;
+        return true;
     }
+    return false;
 }
 
-static char current_char(void) {
-    return lex.data[lex.pos];
+static StringView sv_chop_by_space(StringView *sv) {
+    size_t i = 0;
+    while (i < sv->len && sv->data[i] != ' ')
+        i++;
+    StringView result = {.data = sv->data, .len = i};
+    while (i < sv->len && sv->data[i] == ' ')
+        i++;
+    sv->data += i;
+    sv->len -= i;
+    return result;
 }
 
-static char eat_char(void) {
-    if (lex.len <= lex.pos) {
-        lex.pos = 0;
-        lex.len = 0;
+static bool parse_line(StringView sv, IrcLine *line) {
+    *line = (IrcLine){0};
+    if (sv.data[0] == '@') {
+        sv.data++;
+        sv.len--;
+        line->tags = sv_chop_by_space(&sv);
+    }
+    if (sv.len > 0 && sv.data[0] == ':') {
+        sv.data++;
+        sv.len--;
+        line->prefix = sv_chop_by_space(&sv);
     }
-    irc_listen();
-    if (lex.len <= lex.pos)
-        return '\0';
-    return lex.data[lex.pos++];
+    line->command = sv_chop_by_space(&sv);
+    if (line->command.len == 0)
+        return false;
+    while (sv.len > 0 && line->param_count < IRC_MAX_PARAMS) {
+        if (sv.data[0] == ':') {
+            line->params[line->param_count++] = (StringView){.data = sv.data + 1, .len = sv.len - 1};
+            break;
+        }
+        line->params[line->param_count++] = sv_chop_by_space(&sv);
+    }
+    return true;
+}
+
+static StringView param(const IrcLine *line, size_t i) {
+    if (i >= line->param_count)
+        return (StringView){.data = "", .len = 0};
+    return line->params[i];
 }
 
-static char escape_char(char c) {
-    unsigned char uc = c;
-    return 31 < uc && uc < 128 ? uc : '.';
+static StringView last_param(const IrcLine *line) {
+    if (line->param_count == 0)
+        return (StringView){.data = "", .len = 0};
+    return line->params[line->param_count - 1];
 }
 
-static void skip_char(char c) {
-    char d;
-    if ((d = eat_char()) != c) {
-        printf("Expected %c[%d] but got %c[%d]\n", escape_char(c), c, escape_char(d), d);
-        abort();
+// Value of the message tag `key`. Values are not unescaped, none of the tags
+// toki uses can contain anything that needs escaping.
+static bool line_tag(const IrcLine *line, const char *key, StringView *value) {
+    StringView tags = line->tags;
+    size_t key_len = strlen(key);
+    while (tags.len > 0) {
+        const char *semicolon = memchr(tags.data, ';', tags.len);
+        size_t len = semicolon != NULL ? (size_t)(semicolon - tags.data) : tags.len;
+        StringView tag = {.data = tags.data, .len = len};
+        tags.data += len + (semicolon != NULL);
+        tags.len -= len + (semicolon != NULL);
+        if (tag.len < key_len || memcmp(tag.data, key, key_len) != 0)
+            continue;
+        if (tag.len == key_len) {
+            *value = (StringView){.data = "", .len = 0};
+            return true;
+        }
+        if (tag.data[key_len] == '=') {
+            *value = (StringView){.data = tag.data + key_len + 1, .len = tag.len - key_len - 1};
+            return true;
+        }
     }
+    return false;
 }
 
-static void skip_string(char *c) {
-    while (*c != '\0') {
-        skip_char(*c);
-        c++;
+// IrcCap flags of a space separated capability list, values are ignored
+static uint32_t parse_caps(StringView list) {
+    uint32_t caps = 0;
+    while (list.len > 0) {
+        StringView cap = sv_chop_by_space(&list);
+        const char *eq = memchr(cap.data, '=', cap.len);
+        if (eq != NULL)
+            cap.len = eq - cap.data;
+        for (size_t i = 0; i < ARRLEN(known_caps); i++) {
+            if (sv_equal(cap, known_caps[i].name))
+                caps |= known_caps[i].cap;
+        }
     }
+    return caps;
 }
 
-static void collect_until(StringBuilder *sb, char until) {
-    while (current_char() != until) {
-        da_append(*sb, eat_char());
+static bool parse_digits(StringView sv, size_t at, size_t count, int *n) {
+    if (at + count > sv.len)
+        return false;
+    *n = 0;
+    for (size_t i = at; i < at + count; i++) {
+        if (!isdigit(sv.data[i]))
+            return false;
+        *n = *n * 10 + (sv.data[i] - '0');
     }
+    return true;
 }
 
-static int skip_until(char until) {
-    int n = 0;
-    while (true) {
-        char c = eat_char();
-        if (c == '\0' || c == until)
+// "YYYY-MM-DDThh:mm:ss.sssZ" of server-time to unix milliseconds
+static bool parse_server_time(StringView sv, int64_t *ms) {
+    int year, month, day, hour, minute, second, millis = 0;
+    if (!parse_digits(sv, 0, 4, &year) || !parse_digits(sv, 5, 2, &month) ||
+        !parse_digits(sv, 8, 2, &day) || !parse_digits(sv, 11, 2, &hour) ||
+        !parse_digits(sv, 14, 2, &minute) || !parse_digits(sv, 17, 2, &second))
+        return false;
+    if (month < 1 || month > 12)
+        return false;
+    if (sv.len > 19 && sv.data[19] == '.' && !parse_digits(sv, 20, 3, &millis))
+        millis = 0;
+    // days since 1970-01-01 without going through the local timezone like
+    // mktime does, from http://howardhinnant.github.io/date_algorithms.html
+    int64_t y = year - (month <= 2);
+    int64_t era = y / 400;
+    int64_t year_of_era = y - era * 400;
+    int64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = era * 146097 + day_of_era - 719468;
+    *ms = (((days * 24 + hour) * 60 + minute) * 60 + second) * 1000 + millis;
+    return true;
+}
+
+static double now_seconds(struct timespec ts) {
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void outbound_reset(IrcSocket *s) {
+    s->outbound.head = s->outbound.charged = s->outbound.tail = 0;
+    s->outbound.line_head = s->outbound.line_tail = 0;
+    s->outbound.urgent_head = s->outbound.urgent_len = 0;
+    s->outbound.tokens = flood_control.burst;
+    clock_gettime(CLOCK_MONOTONIC, &s->outbound.refilled_at);
+}
+
+static bool outbound_fits(IrcSocket *s, size_t bytes, size_t lines) {
+    return OUTBOUND_SIZE - (s->outbound.tail - s->outbound.head) >= bytes &&
+           OUTBOUND_MAX_LINES - (s->outbound.line_tail - s->outbound.line_head) >= lines;
+}
+
+static void outbound_put(IrcSocket *s, StringView sv) {
+    size_t off = s->outbound.tail % OUTBOUND_SIZE;
+    size_t first = sv.len < OUTBOUND_SIZE - off ? sv.len : OUTBOUND_SIZE - off;
+    memcpy(s->outbound.data + off, sv.data, first);
+    memcpy(s->outbound.data, sv.data + first, sv.len - first);
+    s->outbound.tail += sv.len;
+}
+
+#define outbound_put_cstr(s, cstr) outbound_put((s), (StringView){.data = (cstr), .len = strlen(cstr)})
+
+static void outbound_begin_line(IrcSocket *s) {
+    s->outbound.line_start = s->outbound.tail;
+}
+
+static void outbound_end_line(IrcSocket *s) {
+    outbound_put_cstr(s, "\r\n");
+    s->outbound.lines[s->outbound.line_tail++ % OUTBOUND_MAX_LINES] = s->outbound.tail - s->outbound.line_start;
+}
+
+// Lines the network thread sends on its own, like the CAP negotiation. They
+// are few and short, so one that does not fit is dropped.
+static void outbound_line(IrcSocket *s, const char *cmd, StringView arg) {
+    if (!outbound_fits(s, strlen(cmd) + arg.len + 2, 1))
+        return;
+    outbound_begin_line(s);
+    outbound_put_cstr(s, cmd);
+    outbound_put(s, arg);
+    outbound_end_line(s);
+}
+
+static void outbound_urgent(IrcSocket *s, const char *cmd, StringView arg) {
+    if (s->outbound.urgent_head == s->outbound.urgent_len)
+        s->outbound.urgent_head = s->outbound.urgent_len = 0;
+    size_t len = strlen(cmd) + arg.len + 2;
+    if (OUTBOUND_URGENT_SIZE - s->outbound.urgent_len < len) {
+        memmove(s->outbound.urgent, s->outbound.urgent + s->outbound.urgent_head,
+                s->outbound.urgent_len - s->outbound.urgent_head);
+        s->outbound.urgent_len -= s->outbound.urgent_head;
+        s->outbound.urgent_head = 0;
+        // the server will just ping again
+        if (OUTBOUND_URGENT_SIZE - s->outbound.urgent_len < len)
+            return;
+    }
+    char *p = s->outbound.urgent + s->outbound.urgent_len;
+    memcpy(p, cmd, strlen(cmd));
+    memcpy(p + strlen(cmd), arg.data, arg.len);
+    memcpy(p + strlen(cmd) + arg.len, "\r\n", 2);
+    s->outbound.urgent_len += len;
+}
+
+// Length of the next piece of `text` that fits into `room` bytes. Prefers
+// breaking after a space and never splits a UTF-8 sequence.
+static size_t split_message(StringView text, size_t room) {
+    if (text.len <= room)
+        return text.len;
+    size_t end = room;
+    while (end > 0 && (text.data[end] & 0xC0) == 0x80)
+        end--;
+    for (size_t i = end; i > room / 2; i--) {
+        if (text.data[i - 1] == ' ')
+            return i;
+    }
+    return end > 0 ? end : room;
+}
+
+// Takes as many channels off the front of a comma separated list as fit into
+// one JOIN line and max_targets, which is 0 for no limit
+static StringView next_join_targets(StringView *targets, size_t max_targets) {
+    size_t room = IRC_LINE_MAX - strlen("JOIN \r\n");
+    size_t len = 0, count = 0, pos = 0;
+    while (pos < targets->len && (max_targets == 0 || count < max_targets)) {
+        const char *comma = memchr(targets->data + pos, ',', targets->len - pos);
+        size_t end = comma != NULL ? (size_t)(comma - targets->data) : targets->len;
+        // a channel too long for any line still gets one of its own
+        if (end > room && count > 0)
             break;
-        n++;
+        len = end;
+        count++;
+        pos = end + 1;
     }
-    return n;
+    StringView result = {.data = targets->data, .len = len};
+    size_t skip = len < targets->len ? len + 1 : len;
+    targets->data += skip;
+    targets->len -= skip;
+    return result;
 }
 
-static int parse_3digit(void) {
-    int n = 0;
-    int pows[3] = {100, 10, 1};
-    for (int i = 0; i < 3; i++) {
-        char c = eat_char();
-        if (!isdigit(c)) {
-            TODO("handle parse_3digit failure properly");
+// Formats the command into the outbound ring, returns false if there is no
+// room for it yet
+static bool outbound_queue_command(IrcSocket *s, const IrcCommand *cmd) {
+    StringView target = sv_from_sb(cmd->target);
+    switch (cmd->kind) {
+    case IRC_COMMAND_CONNECT:
+        break;
+    case IRC_COMMAND_JOIN: {
+        size_t lines = 0;
+        for (StringView rest = target; rest.len > 0; lines++)
+            next_join_targets(&rest, s->join_targmax);
+        if (!outbound_fits(s, lines * strlen("JOIN \r\n") + target.len, lines))
+            return false;
+        while (target.len > 0) {
+            StringView targets = next_join_targets(&target, s->join_targmax);
+            if (targets.len == 0)
+                continue;
+            outbound_begin_line(s);
+            outbound_put_cstr(s, "JOIN ");
+            outbound_put(s, targets);
+            outbound_end_line(s);
+        }
+    } break;
+    case IRC_COMMAND_PRIVMSG: {
+        // long messages are split to keep every line within IRC_LINE_MAX
+        size_t header = strlen("PRIVMSG ") + target.len + strlen(" :");
+        if (header + 2 >= IRC_LINE_MAX)
+            return true;
+        size_t room = IRC_LINE_MAX - header - 2;
+        StringView text = sv_from_sb(cmd->text);
+        size_t lines = 0;
+        for (StringView rest = text; rest.len > 0; lines++) {
+            size_t n = split_message(rest, room);
+            rest.data += n;
+            rest.len -= n;
         }
-        n += (c-'0')*pows[i];
+        if (!outbound_fits(s, lines * (header + 2) + text.len, lines))
+            return false;
+        while (text.len > 0) {
+            size_t n = split_message(text, room);
+            outbound_begin_line(s);
+            outbound_put_cstr(s, "PRIVMSG ");
+            outbound_put(s, target);
+            outbound_put_cstr(s, " :");
+            outbound_put(s, (StringView){.data = text.data, .len = n});
+            outbound_end_line(s);
+            text.data += n;
+            text.len -= n;
+        }
+    } break;
+    case IRC_COMMAND_CHATHISTORY:
+        if (!outbound_fits(s, target.len + cmd->text.len + 23, 1))
+            return false;
+        outbound_begin_line(s);
+        outbound_put_cstr(s, "CHATHISTORY BEFORE ");
+        outbound_put(s, target);
+        outbound_put_cstr(s, " ");
+        outbound_put(s, sv_from_sb(cmd->text));
+        outbound_end_line(s);
+        break;
     }
-    return n;
+    return true;
 }
 
-static int parse_number(void) {
-    char num[10];
-    size_t len = 0;
-    while (isdigit(current_char())) {
-        if (len >= 10) {
-            printf("Int to be parsed is larger than i32 can store\n");
-            TODO("handle parse_number failure properly");
-        }
-        num[len] = eat_char();
-        len++;
+static bool socket_ready(const IrcSocket *s) {
+    return s->fd != -1 && s->registered;
+}
+
+// PRIVMSGs wait for the registration and the JOIN that rejoins the channels
+static void send_deferred(IrcSocket *s) {
+    size_t sent = 0;
+    while (sent < s->deferred.len && socket_ready(s) && s->rejoined &&
+           outbound_queue_command(s, &s->deferred.data[sent])) {
+        free_string_builder(&s->deferred.data[sent].target);
+        free_string_builder(&s->deferred.data[sent].text);
+        sent++;
+    }
+    if (sent == 0)
+        return;
+    memmove(s->deferred.data, s->deferred.data + sent, (s->deferred.len - sent) * sizeof(*s->deferred.data));
+    s->deferred.len -= sent;
+}
+
+static void outbound_charge(IrcSocket *s) {
+    bool unlimited = flood_control.lines_per_second <= 0;
+    if (!unlimited) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        s->outbound.tokens += (now_seconds(now) - now_seconds(s->outbound.refilled_at)) *
+                           flood_control.lines_per_second;
+        if (s->outbound.tokens > flood_control.burst)
+            s->outbound.tokens = flood_control.burst;
+        s->outbound.refilled_at = now;
+    }
+    while (s->outbound.line_head < s->outbound.line_tail && (unlimited || s->outbound.tokens >= 1)) {
+        s->outbound.charged += s->outbound.lines[s->outbound.line_head++ % OUTBOUND_MAX_LINES];
+        s->outbound.tokens -= 1;
     }
+}
+
+static bool outbound_wants_write(IrcSocket *s) {
+    if (s->tls_handshaking)
+        return s->tls_wants_write;
+    return s->tls_wants_write || s->outbound.urgent_head < s->outbound.urgent_len ||
+           s->outbound.head < s->outbound.charged;
+}
+
+// How long poll may sleep before the flood control lets another line through
+static int outbound_timeout(IrcSocket *s) {
+    if (s->outbound.line_head == s->outbound.line_tail || flood_control.lines_per_second <= 0)
+        return -1;
+    double wait = (1 - s->outbound.tokens) / flood_control.lines_per_second;
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+static void outbound_flush(IrcSocket *s) {
+    outbound_charge(s);
+    struct iovec iov[3];
     int n = 0;
-    for (size_t i = 1; i < len+1; i++) {
-        n *= 10;
-        n += num[len-i]-'0';
+    // PING replies have to wait until the stuck record is out
+    bool urgent = s->outbound.urgent_head < s->outbound.urgent_len && !s->tls_retry_ring;
+    if (urgent) {
+        iov[n++] = (struct iovec){
+            .iov_base = s->outbound.urgent + s->outbound.urgent_head,
+            .iov_len = s->outbound.urgent_len - s->outbound.urgent_head,
+        };
+    }
+    size_t pending = s->outbound.charged - s->outbound.head;
+    if (pending > 0) {
+        size_t off = s->outbound.head % OUTBOUND_SIZE;
+        size_t first = pending < OUTBOUND_SIZE - off ? pending : OUTBOUND_SIZE - off;
+        iov[n++] = (struct iovec){.iov_base = s->outbound.data + off, .iov_len = first};
+        if (pending > first)
+            iov[n++] = (struct iovec){.iov_base = s->outbound.data, .iov_len = pending - first};
+    }
+    if (n == 0)
+        return;
+    int blocked;
+    ssize_t written = transport_writev(s, iov, n, &blocked);
+    s->tls_retry_ring = blocked > 0 || (blocked == 0 && !urgent);
+    if (written == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        perror("outbound_flush");
+        disconnect(s);
+        return;
+    }
+    size_t urgent_len = urgent ? s->outbound.urgent_len - s->outbound.urgent_head : 0;
+    if ((size_t)written < urgent_len) {
+        s->outbound.urgent_head += written;
+        return;
+    }
+    if (urgent)
+        s->outbound.urgent_head = s->outbound.urgent_len = 0;
+    s->outbound.head += written - urgent_len;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Message *message_new(MessageType type, uint32_t sender, StringView text) {
+    Message *msg = malloc(offsetof(Message, text) + text.len + 1);
+    assert(msg != NULL);
+    msg->timestamp = now_ms();
+    msg->sender = sender;
+    msg->len = text.len;
+    msg->type = type;
+    memcpy(msg->text, text.data, text.len);
+    msg->text[text.len] = '\0';
+    return msg;
+}
+
+// nick!user@host -> nick
+static StringView prefix_nick(StringView prefix) {
+    const char *bang = memchr(prefix.data, '!', prefix.len);
+    if (bang != NULL)
+        prefix.len = bang - prefix.data;
+    return prefix;
+}
+
+static void free_history(History *history) {
+    for (size_t i = 0; i < history->len; i++) {
+        free(history->data[i].message);
+        free_string_builder(&history->data[i].sender);
+    }
+    free(history->data);
+    free(history);
+}
+
+static void free_event(IrcEvent *ev) {
+    free_string_builder(&ev->target);
+    free_string_builder(&ev->sender);
+    free_string_builder(&ev->text);
+    free(ev->message);
+    ev->message = NULL;
+    if (ev->directory != NULL) {
+        directory_free(ev->directory);
+        free(ev->directory);
+        ev->directory = NULL;
+    }
+    if (ev->history != NULL) {
+        free_history(ev->history);
+        ev->history = NULL;
+    }
+}
+
+// Messages carry the time the server got them when server-time is enabled
+static void stamp_message(const IrcLine *line, Message *msg) {
+    StringView time;
+    int64_t ms;
+    if (line_tag(line, "time", &time) && parse_server_time(time, &ms))
+        msg->timestamp = ms;
+}
+
+static void push_message(IrcSocket *s, const IrcLine *line, IrcEventKind kind, MessageType type, StringView target, StringView text) {
+    IrcEvent ev = {.kind = kind, .conn = s->conn};
+    if (target.len > 0)
+        ev.target = sb_from_sv(target);
+    StringView nick = prefix_nick(line->prefix);
+    if (nick.len > 0)
+        ev.sender = sb_from_sv(nick);
+    ev.message = message_new(type, 0, text);
+    stamp_message(line, ev.message);
+    spsc_push(events, ev);
+}
+
+static void push_event(IrcSocket *s, IrcEventKind kind, StringView target, StringView sender, StringView text) {
+    IrcEvent ev = {.kind = kind, .conn = s->conn};
+    if (target.len > 0)
+        ev.target = sb_from_sv(target);
+    if (sender.len > 0)
+        ev.sender = sb_from_sv(sender);
+    if (text.len > 0)
+        ev.text = sb_from_sv(text);
+    spsc_push(events, ev);
+}
+
+static const StringView no_target = {.data = "", .len = 0};
+
+// Waits for the UI to make room in the event queue, false if the network
+// thread is shutting down first
+static bool wait_for_event_room(void) {
+    while (spsc_full(events) && atomic_load(&network_running))
+        sched_yield();
+    return !spsc_full(events);
+}
+
+// Connection progress, shown next to the connection and in its system
+// messages
+static void push_status(IrcSocket *s, const char *text) {
+    if (spsc_full(events)) {
+        fprintf(stderr, "%s\n", text);
+        return;
     }
+    push_event(s, IRC_EVENT_STATUS, no_target, no_target, sv_from_cstr(text));
+}
+
+static void push_list(IrcSocket *s) {
+    IrcEvent ev = {.kind = IRC_EVENT_LIST, .conn = s->conn, .directory = s->list};
+    s->list = NULL;
+    spsc_push(events, ev);
+}
+
+static uint32_t parse_count(StringView sv) {
+    uint32_t n = 0;
+    for (size_t i = 0; i < sv.len && isdigit(sv.data[i]); i++)
+        n = n * 10 + (sv.data[i] - '0');
     return n;
 }
 
-void irc_connect(StringBuilder *server, StringBuilder *username) {
-    struct addrinfo hints = {0}, *res = NULL;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    char *server_cstr = malloc(server->len+1);
-    server_cstr[server->len] = '\0';
-    memcpy(server_cstr, server->data, server->len);
-    if (getaddrinfo(server_cstr, "6667", &hints, &res) != 0)
-        TODO("handle server being unreachable failure properly");
-    free(server_cstr);
-    for (struct addrinfo *r = res; r; r = r->ai_next) {
-        server_fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-        if (server_fd == -1)
+// Limit of `command` in a TARGMAX value like "JOIN:4,PRIVMSG:", 0 for none
+static size_t parse_targmax(StringView value, const char *command) {
+    while (value.len > 0) {
+        const char *comma = memchr(value.data, ',', value.len);
+        StringView entry = {.data = value.data, .len = comma != NULL ? (size_t)(comma - value.data) : value.len};
+        value.data += entry.len + (comma != NULL);
+        value.len -= entry.len + (comma != NULL);
+        const char *colon = memchr(entry.data, ':', entry.len);
+        if (colon == NULL)
             continue;
-        if (connect(server_fd, r->ai_addr, r->ai_addrlen) == 0)
-            break;
-        close(server_fd);
-        server_fd = -1;
-    }
-    freeaddrinfo(res);
-    // TODO add error message instead of crashing
-    if (server_fd == -1)
-        TODO("handle server being unreachable failure properly");
-    dprintf(server_fd, "NICK %.*s\r\n", (int)username->len, username->data);
-    dprintf(server_fd, "USER %.*s * * :%.*s\r\n",
-            (int)username->len, username->data,
-            (int)username->len, username->data);
-    dprintf(server_fd, "LIST\r\n");
-    if (fcntl(server_fd, F_SETFL, O_NONBLOCK) < 0)
-        TODO("handle fcntl failure properly");
-}
-
-static void parse_int_message(StringBuilder from, IrcReply code) {
-    Message msg = {0};
-    msg.sender = from;
-    Messages *messages = current_channel == -1
-                             ? &system_messages
-                             : &channels.data[current_channel].messages;
-    bool free_from = true;
+        StringView name = {.data = entry.data, .len = colon - entry.data};
+        if (sv_equal(name, command))
+            return parse_count((StringView){.data = colon + 1, .len = entry.len - name.len - 1});
+    }
+    return 0;
+}
+
+static void parse_int_message(IrcSocket *s, const IrcLine *line, IrcReply code) {
     switch (code) {
-    case RPL_WELCOME: {
-        // skip username
-        skip_until(' ');
-        skip_char(':');
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*messages, msg);
-        free_from = false;
-    } break;
+    case RPL_WELCOME:
+        push_message(s, line, IRC_EVENT_MESSAGE, MESSAGE_SERVER, no_target, last_param(line));
+        push_status(s, "");
+        // registration is done, CAP negotiation included
+        outbound_line(s, "LIST", no_target);
+        break;
+    case RPL_YOURHOST:
+    case RPL_CREATED:
+    case RPL_LUSERCLIENT:
+    case RPL_LUSERCHANNELS:
+    case RPL_LUSERME:
+        // <username> [<count>] :<text>
+        push_message(s, line, IRC_EVENT_MESSAGE, MESSAGE_SERVER, no_target, last_param(line));
+        break;
     case RPL_ISUPPORT:
-        // username
-        skip_until(' ');
-        // til end
-        skip_until('\r');
-        skip_char('\n');
+        // <username> <token>... :are supported by this server
+        for (size_t i = 1; i + 1 < line->param_count; i++) {
+            StringView token = line->params[i];
+            const char *eq = memchr(token.data, '=', token.len);
+            StringView key = token, value = no_target;
+            if (eq != NULL) {
+                key.len = eq - token.data;
+                value = (StringView){.data = eq + 1, .len = token.len - key.len - 1};
+            }
+            if (sv_equal(key, "TARGMAX"))
+                s->join_targmax = parse_targmax(value, "JOIN");
+            push_event(s, IRC_EVENT_ISUPPORT, key, no_target, value);
+        }
+        break;
+    case RPL_ENDOFMOTD:
+    case ERR_NOMOTD:
+        // the last thing of the registration burst, ISUPPORT came before it
+        if (!s->registered) {
+            s->registered = true;
+            s->reconnects = 0;
+            s->lag_ping_pending = false;
+            clock_gettime(CLOCK_MONOTONIC, &s->lag_ping_at);
+            push_event(s, IRC_EVENT_REGISTERED, no_target, no_target, no_target);
+        }
+        break;
+    case RPL_MYINFO:
+    case RPL_LOCALUSERS:
+    case RPL_NETUSERS:
+    case RPL_STATSCONN:
+        break;
+    case ERR_NOSUCHCHANNEL:
+    case ERR_TOOMANYCHANNELS:
+    case ERR_CHANNELISFULL:
+    case ERR_INVITEONLYCHAN:
+    case ERR_BANNEDFROMCHAN:
+    case ERR_BADCHANNELKEY:
+        // <nick> <channel> :<reason>
+        push_message(s, line, IRC_EVENT_JOIN_FAILED, MESSAGE_SERVER, param(line, 1), last_param(line));
+        break;
+    case RPL_LISTSTART:
+        // NOTE: afaik, IRC only lists channels, hence we can just skip it
+        break;
+    case RPL_LIST:
+        // <username> <channel> <users> :<topic>
+        if (s->list == NULL) {
+            s->list = calloc(1, sizeof(*s->list));
+            assert(s->list != NULL);
+        }
+        directory_add(s->list, param(line, 1), parse_count(param(line, 2)),
+                      line->param_count > 3 ? last_param(line) : no_target);
+        if (s->list->names.len == LIST_BATCH)
+            push_list(s);
+        break;
+    case RPL_LISTEND:
+        if (s->list == NULL) {
+            s->list = calloc(1, sizeof(*s->list));
+            assert(s->list != NULL);
+        }
+        s->list->complete = true;
+        push_list(s);
+        break;
+    case RPL_TOPIC:
+        // <username> <channel> :<topic>
+        push_event(s, IRC_EVENT_TOPIC, param(line, 1), no_target, last_param(line));
+        break;
+    case RPL_TOPICSETBY:
+        // the client has no way to display it yet
+        break;
+    case RPL_NAMREPLY:
+        // <username> <symbol> <channel> :[prefix]<nick>{ [prefix]<nick>}
+        push_event(s, IRC_EVENT_NAMES, param(line, 2), no_target, last_param(line));
         break;
-    case RPL_CREATED: {
-        // skip username
-        skip_until(' ');
-        skip_char(':');
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*messages, msg);
-        free_from = false;
-    } break;
-    case RPL_MYINFO: {
-        // username
-        skip_until(' ');
-        // server version
-        skip_until(' ');
-        // available umodes
-        skip_until(' ');
-        // available cmodes
-        skip_until(' ');
-        // cmodes with param
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_YOURHOST: {
-        // skip username
-        skip_until(' ');
-        skip_char(':');
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*messages, msg);
-        free_from = false;
-    } break;
-    case RPL_LUSERCLIENT: {
-        // skip username
-        skip_until(' ');
-        skip_char(':');
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*messages, msg);
-        free_from = false;
-    } break;
-    case RPL_LUSERCHANNELS: {
-        // skip username
-        skip_until(' ');
-
-        // TODO do something with it
-        (void)parse_number();
-        skip_string(" :");
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*messages, msg);
-        free_from = false;
-    } break;
-    case RPL_LUSERME: {
-        // skip username
-        skip_until(' ');
-        skip_char(':');
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*messages, msg);
-        free_from = false;
-    } break;
-    case RPL_LOCALUSERS: {
-        // skip username
-        skip_until(' ');
-        // count
-        skip_until(' ');
-        // max
-        skip_until(' ');
-        // till end
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_NETUSERS: {
-        // skip username
-        skip_until(' ');
-        // count
-        skip_until(' ');
-        // max
-        skip_until(' ');
-        // till end
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_STATSCONN: {
-        // skip username
-        skip_until(' ');
-        // till end
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_LISTSTART: {
-        // NOTE: afaik, IRC only lists channels, hence we can just skip this
-        // message, as well as RPL_LISTEND
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_LIST: {
-        // skip username
-        skip_until(' ');
-        da_append_empty(channels);
-        collect_until(&da_last(channels).name, ' ');
-        skip_char(' ');
-        da_append(da_last(channels).name, '\0');
-        da_last(channels).name.len--;
-        // (maybe) TODO: topic
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_LISTEND: {
-        // NOTE: see RPL_LISTSTART
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_TOPIC: {
-        skip_until(' ');
-        StringBuilder channel_name = {0};
-        collect_until(&channel_name, ' ');
-        skip_string(" :");
-        Channel *channel = find_channel(channel_name);
-        collect_until(&channel->topic, '\r');
-        free_string_builder(&channel_name);
-        skip_string("\r\n");
-    } break;
-    case RPL_TOPICSETBY: {
-        // // the client has no way to display it yet
-        // skip_until(' ');
-        // StringBuilder channel = {0};
-        // collect_until(&channel, ' ');
-        // StringBuilder by = {0};
-        // collect_until(&by, ' ');
-        skip_until('\r');
-        skip_char('\n');
-    } break;
-    case RPL_NAMREPLY: {
-        // TODO
-        // // StringBuilder channel_name = {0};
-        // // collect_until(&channel_name, ' ');
-        skip_until('\r');
-        skip_char('\n');
-    } break;
     case RPL_ENDOFNAMES:
-        skip_until('\r');
-        skip_char('\n');
+        // <username> <channel> :End of /NAMES list
+        push_event(s, IRC_EVENT_END_OF_NAMES, param(line, 1), no_target, no_target);
         break;
-    case ERR_NOMOTD: {
-        // skip username
-        skip_until(' ');
-        // till end
-        skip_until('\r');
-        skip_char('\n');
-    } break;
     default:
-        printf("Unimplemented code: %02d\n", code);
-        TODO("Unimplemented code");
+        printf("Unimplemented code: %03d\n", code);
     }
-    if (free_from)
-        free_string_builder(&from);
 }
 
-#define SB(s) (StringBuilder){.data = (s), .len = sizeof(s)-1}
+static void parse_cap(IrcSocket *s, const IrcLine *line) {
+    // <nick> <subcommand> [*] :<capabilities>
+    StringView subcommand = param(line, 1);
+    if (sv_equal(subcommand, "LS")) {
+        StringView list = last_param(line);
+        while (list.len > 0) {
+            StringView cap = sv_chop_by_space(&list);
+            const char *eq = memchr(cap.data, '=', cap.len);
+            if (eq != NULL)
+                cap.len = eq - cap.data;
+            uint32_t flag = parse_caps(cap);
+            // both names of chathistory may be offered, one is enough
+            if (flag == 0 || (s->offered_caps & flag) != 0)
+                continue;
+            s->offered_caps |= flag;
+            if (s->wanted_caps.len > 0)
+                da_append(s->wanted_caps, ' ');
+            da_append_many(s->wanted_caps, cap.data, cap.len);
+        }
+        // a * before the list means more lines follow
+        if (line->param_count > 3 && sv_equal(param(line, 2), "*"))
+            return;
+        if (s->wanted_caps.len > 0)
+            outbound_line(s, "CAP REQ :", sv_from_sb(s->wanted_caps));
+        else
+            outbound_line(s, "CAP END", no_target);
+    } else if (sv_equal(subcommand, "ACK")) {
+        push_event(s, IRC_EVENT_CAPS, no_target, no_target, last_param(line));
+        outbound_line(s, "CAP END", no_target);
+    } else if (sv_equal(subcommand, "NAK")) {
+        outbound_line(s, "CAP END", no_target);
+    }
+}
+
+static void free_batch(Batch *batch) {
+    free_string_builder(&batch->id);
+    free_string_builder(&batch->target);
+    if (batch->history != NULL)
+        free_history(batch->history);
+}
+
+static Batch *find_batch(IrcSocket *s, StringView id) {
+    for (size_t i = 0; i < s->batches.len; i++) {
+        StringBuilder *other = &s->batches.data[i].id;
+        if (other->len == id.len && memcmp(other->data, id.data, id.len) == 0)
+            return &s->batches.data[i];
+    }
+    return NULL;
+}
 
-static void parse_str_message(StringBuilder from) {
-    StringBuilder command = {0};
-    collect_until(&command, ' ');
-    skip_char(' ');
-    Message msg = {0};
-    msg.sender = from;
-    if (str_equal(command, SB("JOIN"))) {
-        StringBuilder channel_name = {0};
-        skip_char(':');
-        collect_until(&channel_name, '\r');
-        skip_string("\r\n");
-        msg.text = SB("joined");
-        Channel *channel = find_channel(channel_name);
-        free_string_builder(&channel_name);
-        da_append(channel->messages, msg);
-    } else if (str_equal(command, SB("PRIVMSG"))) {
+static void parse_batch(IrcSocket *s, const IrcLine *line) {
+    // +<id> <type> [<parameter>...] or -<id>
+    StringView reference = param(line, 0);
+    if (reference.len < 2)
+        return;
+    StringView id = {.data = reference.data + 1, .len = reference.len - 1};
+    if (reference.data[0] == '+') {
+        Batch batch = {.id = sb_from_sv(id), .target = sb_from_sv(param(line, 2))};
+        if (sv_equal(param(line, 1), "chathistory")) {
+            batch.history = calloc(1, sizeof(*batch.history));
+            assert(batch.history != NULL);
+        }
+        da_append(s->batches, batch);
+        return;
+    }
+    Batch *batch = find_batch(s, id);
+    if (reference.data[0] != '-' || batch == NULL)
+        return;
+    if (batch->history != NULL) {
+        // the whole page is handed over at once
+        IrcEvent ev = {.kind = IRC_EVENT_HISTORY, .conn = s->conn, .target = batch->target, .history = batch->history};
+        batch->target = (StringBuilder){0};
+        batch->history = NULL;
+        spsc_push(events, ev);
+    }
+    free_batch(batch);
+    *batch = da_last(s->batches);
+    s->batches.len--;
+}
+
+static int64_t elapsed_ms(struct timespec since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+// The answer to our lag PING, see lag_ping
+static void parse_pong(IrcSocket *s, const IrcLine *line) {
+    if (!s->lag_ping_pending || !sv_equal(last_param(line), LAG_PING_TOKEN))
+        return;
+    s->lag_ping_pending = false;
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", (long long)elapsed_ms(s->lag_ping_sent));
+    push_event(s, IRC_EVENT_LAG, no_target, no_target, sv_from_cstr(text));
+}
+
+static void parse_str_message(IrcSocket *s, const IrcLine *line) {
+    if (sv_equal(line->command, "JOIN")) {
+        push_message(s, line, IRC_EVENT_JOIN, MESSAGE_JOIN, param(line, 0), no_target);
+    } else if (sv_equal(line->command, "PRIVMSG")) {
         // TODO multiple targets
-        StringBuilder to = {0};
-        collect_until(&to, ' ');
-        Messages *where = NULL;
-        if (to.data[0] == '#') {
-            Channel *channel = find_channel(to);
-            where = &channel->messages;
-        } else {
-            // TODO
-            TODO("Direct messages");
+        StringView to = param(line, 0);
+        if (to.len == 0 || to.data[0] != '#') {
+            // Direct messages and other targets go with the system messages,
+            // CTCP requests like VERSION are not answered
+            StringView text = last_param(line);
+            if (text.len == 0 || text.data[0] != '\x01')
+                push_message(s, line, IRC_EVENT_MESSAGE, MESSAGE_NORMAL, no_target, text);
+            return;
         }
-        skip_string(" :");
-        collect_until(&msg.text, '\r');
-        skip_string("\r\n");
-        da_append(*where, msg);
+        StringView id;
+        Batch *batch = line_tag(line, "batch", &id) ? find_batch(s, id) : NULL;
+        if (batch != NULL && batch->history != NULL) {
+            Message *msg = message_new(MESSAGE_NORMAL, 0, last_param(line));
+            stamp_message(line, msg);
+            HistoryLine history_line = {.message = msg, .sender = sb_from_sv(prefix_nick(line->prefix))};
+            da_append(*batch->history, history_line);
+            return;
+        }
+        push_message(s, line, IRC_EVENT_MESSAGE, MESSAGE_NORMAL, to, last_param(line));
+    } else if (sv_equal(line->command, "PART")) {
+        // <channel>{,<channel>} [<reason>]
+        StringView targets = param(line, 0);
+        while (targets.len > 0 && wait_for_event_room()) {
+            const char *comma = memchr(targets.data, ',', targets.len);
+            StringView target = {.data = targets.data, .len = comma != NULL ? (size_t)(comma - targets.data) : targets.len};
+            push_event(s, IRC_EVENT_PART, target, prefix_nick(line->prefix), no_target);
+            targets.data += target.len + (comma != NULL);
+            targets.len -= target.len + (comma != NULL);
+        }
+    } else if (sv_equal(line->command, "QUIT")) {
+        push_event(s, IRC_EVENT_QUIT, no_target, prefix_nick(line->prefix), no_target);
+    } else if (sv_equal(line->command, "NICK")) {
+        push_event(s, IRC_EVENT_NICK, no_target, prefix_nick(line->prefix), param(line, 0));
+    } else if (sv_equal(line->command, "CAP")) {
+        parse_cap(s, line);
+    } else if (sv_equal(line->command, "BATCH")) {
+        parse_batch(s, line);
+    } else if (sv_equal(line->command, "PONG")) {
+        parse_pong(s, line);
     } else {
-        printf("Unimplemented command: %.*s\n", (int)command.len, command.data);
-        TODO("Unimplemented command");
-    }
-    free_string_builder(&command);
-}
-
-void irc_proccess(void) {
-    irc_listen();
-    while (lex.len-lex.pos > 0) {
-        if (current_char() == 'P') {
-            skip_string("PING ");
-            StringBuilder origin = {0};
-            collect_until(&origin, '\r');
-            skip_string("\r\n");
-            dprintf(server_fd, "PONG %.*s\r\n", (int)origin.len, origin.data);
-            free_string_builder(&origin);
+        printf("Unimplemented command: %.*s\n", (int)line->command.len, line->command.data);
+    }
+}
+
+static bool is_numeric(StringView command) {
+    return command.len == 3 && isdigit(command.data[0]) &&
+           isdigit(command.data[1]) && isdigit(command.data[2]);
+}
+
+// Parses everything that is available on the socket. Stops early, leaving
+// the rest in the read buffer, when the UI has not caught up with the events
+static void irc_read_lines(IrcSocket *s) {
+    size_t lines_before = s->lex.lines;
+    while (s->fd != -1) {
+        StringView sv;
+        while (spsc_free(events) >= IRC_LINE_EVENTS && next_line(s, &sv)) {
+            IrcLine line;
+            if (!parse_line(sv, &line))
+                continue;
+            if (sv_equal(line.command, "PING")) {
+                outbound_urgent(s, "PONG :", param(&line, 0));
+            } else if (is_numeric(line.command)) {
+                IrcReply code = (line.command.data[0] - '0') * 100 +
+                                (line.command.data[1] - '0') * 10 +
+                                (line.command.data[2] - '0');
+                parse_int_message(s, &line, code);
+            } else {
+                parse_str_message(s, &line);
+            }
+        }
+        if (spsc_free(events) < IRC_LINE_EVENTS || !irc_listen(s))
+            break;
+    }
+    atomic_fetch_add_explicit(&lines_parsed, s->lex.lines - lines_before, memory_order_relaxed);
+}
+
+static int tls_new_session(SSL *ssl, SSL_SESSION *session) {
+    IrcSocket *s = SSL_get_app_data(ssl);
+    for (size_t i = 0; i < tls_sessions.len; i++) {
+        if (strcmp(tls_sessions.data[i].host, s->host) == 0 && strcmp(tls_sessions.data[i].port, s->port) == 0) {
+            SSL_SESSION_free(tls_sessions.data[i].session);
+            tls_sessions.data[i].session = session;
+            return 1;
+        }
+    }
+    da_append(tls_sessions, ((TlsSession){.host = strdup(s->host), .port = strdup(s->port), .session = session}));
+    // we keep the reference
+    return 1;
+}
+
+static bool tls_init(void) {
+    if (tls_ctx != NULL)
+        return true;
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    if (tls_ctx == NULL)
+        return false;
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_default_verify_paths(tls_ctx);
+    if (tls_config.ca_file != NULL && !SSL_CTX_load_verify_locations(tls_ctx, tls_config.ca_file, NULL))
+        ERR_print_errors_fp(stderr);
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // sessions are only kept by tls_new_session
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_ctx, tls_new_session);
+    return true;
+}
+
+// Sets up the TLS state on the network thread, the handshake itself goes on
+// in tls_handshake whenever the socket is ready
+static void tls_start(IrcSocket *s) {
+    s->tls = SSL_new(tls_ctx);
+    if (s->tls == NULL || !SSL_set_fd(s->tls, s->fd)) {
+        ERR_print_errors_fp(stderr);
+        push_status(s, "Could not set up TLS");
+        disconnect(s);
+        return;
+    }
+    SSL_set_app_data(s->tls, s);
+    SSL_set_tlsext_host_name(s->tls, s->host);
+    if (tls_config.verify) {
+        SSL_set_verify(s->tls, SSL_VERIFY_PEER, NULL);
+        // works for both names and IP addresses
+        X509_VERIFY_PARAM *param = SSL_get0_param(s->tls);
+        if (!X509_VERIFY_PARAM_set1_ip_asc(param, s->host))
+            SSL_set1_host(s->tls, s->host);
+    }
+    for (size_t i = 0; i < tls_sessions.len; i++) {
+        if (strcmp(tls_sessions.data[i].host, s->host) == 0 && strcmp(tls_sessions.data[i].port, s->port) == 0)
+            SSL_set_session(s->tls, tls_sessions.data[i].session);
+    }
+    s->tls_handshaking = true;
+    push_status(s, "TLS handshake...");
+}
+
+static void tls_handshake(IrcSocket *s) {
+    s->tls_wants_write = false;
+    int ret = SSL_connect(s->tls);
+    if (ret == 1) {
+        s->tls_handshaking = false;
+        push_status(s, SSL_session_reused(s->tls) ? "Registering... (TLS session resumed)" : "Registering...");
+        return;
+    }
+    if (tls_error(s, ret) < 0 && errno == EAGAIN)
+        return;
+    long verify = SSL_get_verify_result(s->tls);
+    char text[256];
+    snprintf(text, sizeof(text), "TLS handshake failed: %s",
+             verify != X509_V_OK ? X509_verify_cert_error_string(verify) : "connection closed");
+    push_status(s, text);
+    disconnect(s);
+}
+
+static void wake_network_thread(void) {
+    // if the pipe is full the thread is going to wake up anyway
+    (void)!write(wake_fds[1], "", 1);
+}
+
+static void free_resolver(Resolver *r) {
+    pthread_mutex_destroy(&r->lock);
+    free(r->host);
+    free(r->port);
+    free(r);
+}
+
+static void *resolve(void *arg) {
+    Resolver *r = arg;
+    struct addrinfo hints = {0}, *addresses = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    int error = getaddrinfo(r->host, r->port, &hints, &addresses);
+    pthread_mutex_lock(&r->lock);
+    bool abandoned = r->abandoned;
+    if (!abandoned) {
+        r->addresses = addresses;
+        r->error = error;
+        r->done = true;
+        // while the lock is held irc_close can not close the pipe yet
+        wake_network_thread();
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (abandoned) {
+        if (error == 0)
+            freeaddrinfo(addresses);
+        free_resolver(r);
+    }
+    return NULL;
+}
+
+// Returns true if the resolver is already done and can be freed by the caller
+static bool abandon_resolver(Resolver *r) {
+    pthread_mutex_lock(&r->lock);
+    bool done = r->done;
+    r->abandoned = true;
+    pthread_mutex_unlock(&r->lock);
+    return done;
+}
+
+static bool start_resolver(IrcSocket *s) {
+    Resolver *r = calloc(1, sizeof(*r));
+    assert(r != NULL);
+    pthread_mutex_init(&r->lock, NULL);
+    r->host = strdup(s->host);
+    r->port = strdup(s->port);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, resolve, r) != 0) {
+        free_resolver(r);
+        return false;
+    }
+    pthread_detach(thread);
+    s->resolver = r;
+    return true;
+}
+
+// RFC 8305: the preferred family first, then alternating between the two
+static void order_candidates(IrcSocket *s) {
+    s->candidates.len = 0;
+    int first_family = s->addresses != NULL ? s->addresses->ai_family : AF_UNSPEC;
+    const struct addrinfo *preferred = s->addresses, *other = s->addresses;
+    bool take_preferred = true;
+    for (;;) {
+        while (preferred != NULL && preferred->ai_family != first_family)
+            preferred = preferred->ai_next;
+        while (other != NULL && other->ai_family == first_family)
+            other = other->ai_next;
+        if (preferred == NULL && other == NULL)
+            break;
+        const struct addrinfo **next = (take_preferred && preferred != NULL) || other == NULL ? &preferred : &other;
+        da_append(s->candidates, *next);
+        *next = (*next)->ai_next;
+        take_preferred = !take_preferred;
+    }
+}
+
+static void close_attempts(IrcSocket *s, int keep) {
+    for (size_t i = 0; i < s->attempts.len; i++) {
+        if (s->attempts.data[i].fd != keep)
+            close(s->attempts.data[i].fd);
+    }
+    s->attempts.len = 0;
+}
+
+static void start_attempt(IrcSocket *s, const struct addrinfo *address) {
+    char host[64] = "?", text[128];
+    getnameinfo(address->ai_addr, address->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+    snprintf(text, sizeof(text), "Connecting to %s...", host);
+    push_status(s, text);
+    clock_gettime(CLOCK_MONOTONIC, &s->attempt_started);
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd == -1) {
+        s->connect_error = errno;
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+        (connect(fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        s->connect_error = errno;
+        close(fd);
+        return;
+    }
+    // even one that connected right away is picked up by the next poll
+    da_append(s->attempts, ((ConnectAttempt){.fd = fd, .address = address}));
+}
+
+static void connect_done(IrcSocket *s, int fd, const struct addrinfo *address) {
+    char host[64] = "?", text[128];
+    getnameinfo(address->ai_addr, address->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+    snprintf(text, sizeof(text), "Connected to %s in %lld ms", host, (long long)elapsed_ms(s->connect_started));
+    push_status(s, text);
+    close_attempts(s, fd);
+    freeaddrinfo(s->addresses);
+    s->addresses = NULL;
+    s->candidates.len = 0;
+    s->connecting = false;
+    s->fd = fd;
+    if (tls_config.enabled)
+        tls_start(s);
+    else
+        push_status(s, "Registering...");
+}
+
+static void connect_failed(IrcSocket *s, const char *error) {
+    char text[512];
+    snprintf(text, sizeof(text), "Could not connect to %s: %s", s->host, error);
+    push_status(s, text);
+    close_attempts(s, -1);
+    if (s->addresses != NULL)
+        freeaddrinfo(s->addresses);
+    s->addresses = NULL;
+    s->candidates.len = 0;
+    s->connecting = false;
+}
+
+// Moves connection setup along without ever blocking: waits for the
+// resolver, then races the addresses with connects started
+// CONNECT_ATTEMPT_DELAY_MS apart. The first one to succeed wins.
+static void connect_step(IrcSocket *s) {
+    if (s->resolver != NULL) {
+        Resolver *r = s->resolver;
+        pthread_mutex_lock(&r->lock);
+        bool done = r->done;
+        pthread_mutex_unlock(&r->lock);
+        if (!done)
+            return;
+        s->resolver = NULL;
+        int error = r->error;
+        s->addresses = r->addresses;
+        free_resolver(r);
+        if (error != 0) {
+            connect_failed(s, gai_strerror(error));
+            return;
+        }
+        order_candidates(s);
+    }
+    for (size_t i = 0; i < s->attempts.len;) {
+        ConnectAttempt attempt = s->attempts.data[i];
+        struct pollfd pfd = {.fd = attempt.fd, .events = POLLOUT};
+        if (poll(&pfd, 1, 0) <= 0) {
+            i++;
             continue;
         }
-        skip_char(':');
-        StringBuilder from = {0};
-        collect_until(&from, ' ');
-        skip_char(' ');
-        if (isdigit(current_char())) {
-            IrcReply code = parse_3digit();
-            skip_char(' ');
-            parse_int_message(from, code);
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(attempt.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+            error = errno;
+        if (error == 0) {
+            connect_done(s, attempt.fd, attempt.address);
+            return;
+        }
+        s->connect_error = error;
+        close(attempt.fd);
+        s->attempts.data[i] = da_last(s->attempts);
+        s->attempts.len--;
+    }
+    // a failed attempt does not have to wait for the delay
+    while (s->next_candidate < s->candidates.len &&
+           (s->attempts.len == 0 || elapsed_ms(s->attempt_started) >= CONNECT_ATTEMPT_DELAY_MS))
+        start_attempt(s, s->candidates.data[s->next_candidate++]);
+    if (s->attempts.len == 0)
+        connect_failed(s, s->connect_error != 0 ? strerror(s->connect_error) : "no addresses");
+}
+
+// How long poll may sleep before the next address has to be tried
+static int connect_timeout(IrcSocket *s) {
+    if (!s->connecting || s->resolver != NULL || s->next_candidate == s->candidates.len)
+        return -1;
+    int64_t wait = CONNECT_ATTEMPT_DELAY_MS - elapsed_ms(s->attempt_started);
+    return wait > 0 ? (int)wait + 1 : 0;
+}
+
+// Queued first thing on every connection, the ring is empty at that point
+static void queue_registration(IrcSocket *s) {
+    StringView nick = sv_from_cstr(s->nick);
+    // servers without CAP ignore it, the others wait for CAP END before
+    // finishing the registration
+    outbound_line(s, "CAP LS 302", no_target);
+    outbound_line(s, "NICK ", nick);
+    outbound_begin_line(s);
+    outbound_put_cstr(s, "USER ");
+    outbound_put(s, nick);
+    outbound_put_cstr(s, " * * :");
+    outbound_put(s, nick);
+    outbound_end_line(s);
+}
+
+static void add_ms(struct timespec *ts, int64_t ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// Sends the next lag PING once it is due. It skips the queue like PONGs, so
+// the lag is the server's and not our own flood control's. A PING that is
+// still unanswered when the next one is due counts as that much lag so far.
+static void lag_ping(IrcSocket *s) {
+    if (!s->registered || elapsed_ms(s->lag_ping_at) < 0)
+        return;
+    if (s->lag_ping_pending) {
+        if (spsc_full(events))
+            return;
+        char text[32];
+        snprintf(text, sizeof(text), "%lld", (long long)elapsed_ms(s->lag_ping_sent));
+        push_event(s, IRC_EVENT_LAG, no_target, no_target, sv_from_cstr(text));
+    } else {
+        outbound_urgent(s, "PING :", sv_from_cstr(LAG_PING_TOKEN));
+        s->lag_ping_pending = true;
+        clock_gettime(CLOCK_MONOTONIC, &s->lag_ping_sent);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->lag_ping_at);
+    add_ms(&s->lag_ping_at, LAG_PING_INTERVAL_MS);
+}
+
+static int lag_timeout(IrcSocket *s) {
+    if (!s->registered)
+        return -1;
+    int64_t wait = -elapsed_ms(s->lag_ping_at);
+    return wait > 0 ? (int)wait : 0;
+}
+
+// Network thread only
+static uint64_t random_state = 0;
+
+static uint64_t random_u64(void) {
+    if (random_state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        random_state = ((uint64_t)ts.tv_sec << 32 ^ (uint64_t)ts.tv_nsec) | 1;
+    }
+    // xorshift64
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void push_disconnected(IrcSocket *s) {
+    // the UI is told even if it has to wait for room
+    if (wait_for_event_room())
+        push_event(s, IRC_EVENT_DISCONNECTED, no_target, no_target, no_target);
+}
+
+// Tells the UI and schedules the next connection. The delay doubles with
+// every attempt that does not get through registration and is jittered, so a
+// restarting server is not hit by all of its clients at once.
+static void socket_closed(IrcSocket *s) {
+    push_disconnected(s);
+    int64_t delay = RECONNECT_FIRST_MS;
+    for (int i = 0; i < s->reconnects && delay < RECONNECT_MAX_MS; i++)
+        delay *= 2;
+    if (delay > RECONNECT_MAX_MS)
+        delay = RECONNECT_MAX_MS;
+    delay = delay / 2 + random_u64() % (delay / 2 + 1);
+    s->reconnects++;
+    s->reconnecting = true;
+    clock_gettime(CLOCK_MONOTONIC, &s->reconnect_at);
+    add_ms(&s->reconnect_at, delay);
+    char text[64];
+    snprintf(text, sizeof(text), "Reconnecting in %.1f s...", delay / 1000.0);
+    push_status(s, text);
+}
+
+// Throws away everything of the last connection and starts over
+static void reconnect(IrcSocket *s) {
+    s->reconnecting = false;
+    SSL_free(s->tls);
+    s->tls = NULL;
+    s->tls_handshaking = s->tls_wants_write = s->tls_retry_ring = false;
+    s->lex.len = s->lex.pos = 0;
+    s->lex.overflow = false;
+    outbound_reset(s);
+    if (s->list != NULL) {
+        directory_free(s->list);
+        free(s->list);
+        s->list = NULL;
+    }
+    s->wanted_caps.len = 0;
+    s->offered_caps = 0;
+    for (size_t i = 0; i < s->batches.len; i++)
+        free_batch(&s->batches.data[i]);
+    s->batches.len = 0;
+    s->registered = s->rejoined = false;
+    s->next_candidate = 0;
+    s->connect_error = 0;
+    queue_registration(s);
+    s->connecting = true;
+    clock_gettime(CLOCK_MONOTONIC, &s->connect_started);
+    if (start_resolver(s))
+        push_status(s, "Resolving...");
+    else
+        connect_failed(s, "could not start the resolver");
+}
+
+static IrcSocket *new_socket(IrcConnection *conn, int fd) {
+    IrcSocket *s = calloc(1, sizeof(*s));
+    assert(s != NULL);
+    s->conn = conn;
+    s->fd = fd;
+    outbound_reset(s);
+    return s;
+}
+
+static void free_socket(IrcSocket *s) {
+    if (s->fd != -1)
+        close(s->fd);
+    if (s->resolver != NULL && abandon_resolver(s->resolver)) {
+        if (s->resolver->error == 0)
+            freeaddrinfo(s->resolver->addresses);
+        free_resolver(s->resolver);
+    }
+    close_attempts(s, -1);
+    free(s->attempts.data);
+    if (s->addresses != NULL)
+        freeaddrinfo(s->addresses);
+    free(s->candidates.data);
+    SSL_free(s->tls);
+    free(s->host);
+    free(s->port);
+    free(s->nick);
+    free(s->lex.data);
+    if (s->list != NULL) {
+        directory_free(s->list);
+        free(s->list);
+    }
+    free_string_builder(&s->wanted_caps);
+    for (size_t i = 0; i < s->batches.len; i++)
+        free_batch(&s->batches.data[i]);
+    free(s->batches.data);
+    for (size_t i = 0; i < s->deferred.len; i++) {
+        free_string_builder(&s->deferred.data[i].target);
+        free_string_builder(&s->deferred.data[i].text);
+    }
+    free(s->deferred.data);
+    free(s);
+}
+
+static void irc_send_commands(void) {
+    while (!spsc_empty(commands)) {
+        IrcCommand *cmd = &spsc_front(commands);
+        IrcSocket *s = cmd->socket;
+        if (cmd->kind == IRC_COMMAND_PRIVMSG && (!socket_ready(s) || s->deferred.len > 0)) {
+            // kept until the socket is registered again, so nothing typed
+            // while reconnecting is lost
+            da_append(s->deferred, *cmd);
+            spsc_pop(commands);
+            continue;
+        }
+        if (cmd->kind == IRC_COMMAND_CONNECT) {
+            da_append(sockets, s);
+            clock_gettime(CLOCK_MONOTONIC, &s->connect_started);
+            if (start_resolver(s)) {
+                push_status(s, "Resolving...");
+            } else {
+                connect_failed(s, "could not start the resolver");
+            }
+        } else if (socket_ready(s) && !outbound_queue_command(s, cmd)) {
+            // commands that do not fit yet stay in the queue until the ring
+            // drains
+            break;
+        } else if (cmd->kind == IRC_COMMAND_JOIN && socket_ready(s)) {
+            s->rejoined = true;
+        }
+        // JOIN and CHATHISTORY are dropped before registration, the UI joins
+        // its channels again on IRC_EVENT_REGISTERED and asks for history
+        // once it is connected
+        free_string_builder(&cmd->target);
+        free_string_builder(&cmd->text);
+        spsc_pop(commands);
+    }
+    for (size_t i = 0; i < sockets.len; i++)
+        send_deferred(sockets.data[i]);
+}
+
+static void *irc_network_loop(void *arg) {
+    (void)arg;
+    struct {
+        struct pollfd *data;
+        size_t len, cap;
+    } fds = {0};
+    // events.tail when the UI was last told about new events
+    size_t notified = 0;
+    while (atomic_load(&network_running)) {
+        // while the event queue has no room for another line the sockets are
+        // left alone and we only check back every few milliseconds
+        bool can_read = spsc_free(events) >= IRC_LINE_EVENTS;
+        int timeout = can_read ? -1 : 5;
+        fds.len = 0;
+        da_append(fds, ((struct pollfd){.fd = wake_fds[0], .events = POLLIN}));
+        for (size_t i = 0; i < sockets.len; i++) {
+            IrcSocket *s = sockets.data[i];
+            short events = (can_read || s->tls_handshaking ? POLLIN : 0) | (outbound_wants_write(s) ? POLLOUT : 0);
+            // poll skips negative fds, disconnected sockets keep their slot
+            da_append(fds, ((struct pollfd){.fd = s->fd, .events = events}));
+            // only to wake up, connect_step looks at them itself
+            for (size_t j = 0; j < s->attempts.len; j++)
+                da_append(fds, ((struct pollfd){.fd = s->attempts.data[j].fd, .events = POLLOUT}));
+            int t = s->reconnecting ? (int)(-elapsed_ms(s->reconnect_at)) + 1
+                    : s->connecting ? connect_timeout(s)
+                    : outbound_timeout(s);
+            int lag = s->fd != -1 && !s->connecting && !s->reconnecting ? lag_timeout(s) : -1;
+            if (lag != -1 && (t < 0 || lag < t))
+                t = lag;
+            if (t < 0)
+                t = s->reconnecting ? 0 : -1;
+            if (t != -1 && (timeout == -1 || t < timeout))
+                timeout = t;
+        }
+        if (poll(fds.data, fds.len, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        if (fds.data[0].revents & POLLIN) {
+            char buf[64];
+            while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+        irc_send_commands();
+        for (size_t i = 0; i < sockets.len; i++) {
+            IrcSocket *s = sockets.data[i];
+            if (s->reconnecting) {
+                if (elapsed_ms(s->reconnect_at) < 0)
+                    continue;
+                reconnect(s);
+            }
+            if (s->connecting) {
+                connect_step(s);
+                if (s->connecting)
+                    continue;
+                if (s->fd == -1) {
+                    socket_closed(s);
+                    continue;
+                }
+            }
+            if (s->tls_handshaking)
+                tls_handshake(s);
+            if (can_read && s->fd != -1 && !s->tls_handshaking)
+                irc_read_lines(s);
+            if (s->fd != -1 && !s->tls_handshaking) {
+                lag_ping(s);
+                outbound_flush(s);
+            }
+            if (s->fd == -1)
+                socket_closed(s);
+        }
+        size_t tail = atomic_load_explicit(&events.tail, memory_order_relaxed);
+        if (tail != notified && wake_ui != NULL && !atomic_exchange(&ui_woken, true))
+            wake_ui();
+        notified = tail;
+    }
+    free(fds.data);
+    return NULL;
+}
+
+// Returns false if the network thread is not keeping up, the caller may try
+// again on a later frame
+static bool push_command(IrcCommand cmd) {
+    if (!atomic_load(&network_running) || spsc_full(commands)) {
+        free_string_builder(&cmd.target);
+        free_string_builder(&cmd.text);
+        return false;
+    }
+    spsc_push(commands, cmd);
+    wake_network_thread();
+    return true;
+}
+
+// Our own message came back from the server with echo-message. Long messages
+// come back in several pieces, see split_message.
+// Echoes usually come in order, but one that never arrives must not keep the
+// later ones pending, so the first line that starts with the text is taken.
+// An echo the server changed leaves every line pending.
+static void consume_echo(Channel *channel, const Message *msg) {
+    size_t i = 0;
+    while (i < channel->unechoed.len && (channel->unechoed.data[i].len < msg->len ||
+                                         memcmp(channel->unechoed.data[i].data, msg->text, msg->len) != 0))
+        i++;
+    if (i == channel->unechoed.len)
+        return;
+    StringBuilder *pending = &channel->unechoed.data[i];
+    size_t consumed = msg->len;
+    // servers may strip the space a piece ended with
+    while (consumed < pending->len && pending->data[consumed] == ' ')
+        consumed++;
+    memmove(pending->data, pending->data + consumed, pending->len - consumed);
+    pending->len -= consumed;
+    if (pending->len > 0)
+        return;
+    free_string_builder(pending);
+    memmove(pending, pending + 1, (channel->unechoed.len - i - 1) * sizeof(StringBuilder));
+    channel->unechoed.len--;
+}
+
+static void drop_unechoed(IrcConnection *conn, Channel *channel) {
+    for (size_t i = 0; i < channel->unechoed.len; i++) {
+        StringBuilder text = {0};
+        da_append_many(text, "Not confirmed by the server: ", strlen("Not confirmed by the server: "));
+        da_append_many(text, channel->unechoed.data[i].data, channel->unechoed.data[i].len);
+        irc_add_message(conn, channel, message_new(MESSAGE_CLIENT, 0, sv_from_sb(text)));
+        free_string_builder(&text);
+        free_string_builder(&channel->unechoed.data[i]);
+    }
+    channel->unechoed.len = 0;
+}
+
+static void apply_event(IrcEvent *ev) {
+    IrcConnection *conn = ev->conn;
+    Channel *channel = NULL;
+    if (ev->target.len > 0 && ev->kind != IRC_EVENT_LIST && ev->kind != IRC_EVENT_ISUPPORT &&
+        ev->kind != IRC_EVENT_CAPS && ev->kind != IRC_EVENT_STATUS) {
+        StringView name = sv_from_sb(ev->target);
+        channel = channels_find(&conn->channels, name);
+        if (channel == NULL && ev->kind == IRC_EVENT_JOIN &&
+            casefold_equal(conn->channels.casemapping, sv_from_sb(ev->sender), sv_from_sb(conn->nick))) {
+            // we got joined to a channel we did not know about
+            channel = channels_add(&conn->channels, name);
+        }
+        if (channel == NULL)
+            goto done;
+    }
+    // a line that left out its channel
+    if (channel == NULL && (ev->kind == IRC_EVENT_JOIN || ev->kind == IRC_EVENT_JOIN_FAILED || ev->kind == IRC_EVENT_TOPIC ||
+                            ev->kind == IRC_EVENT_NAMES || ev->kind == IRC_EVENT_END_OF_NAMES || ev->kind == IRC_EVENT_PART))
+        goto done;
+    switch (ev->kind) {
+    case IRC_EVENT_MESSAGE:
+    case IRC_EVENT_JOIN: {
+        ev->message->sender = intern(&conn->senders, sv_from_sb(ev->sender));
+        if (ev->kind == IRC_EVENT_MESSAGE && channel != NULL && channel->unechoed.len > 0 &&
+            ev->message->sender == intern(&conn->senders, sv_from_sb(conn->nick)))
+            consume_echo(channel, ev->message);
+        if (ev->kind == IRC_EVENT_JOIN) {
+            if (ev->message->sender == intern(&conn->senders, sv_from_sb(conn->nick))) {
+                channels_set_joined(&conn->channels, channel, true);
+                channel->join_pending = false;
+            }
+            members_join(conn, channel, ev->message->sender, 0);
+        }
+        // server numerics show up in the open channel, anything else without
+        // a channel, like a direct message, goes with the system messages
+        if (channel == NULL && ev->message->type == MESSAGE_SERVER && current_connection != -1 &&
+            connections.data[current_connection] == conn && current_channel != -1)
+            channel = conn->channels.data[current_channel];
+        irc_add_message(conn, channel, ev->message);
+        ev->message = NULL;
+    } break;
+    case IRC_EVENT_JOIN_FAILED:
+        channel->join_pending = false;
+        ev->message->sender = intern(&conn->senders, sv_from_sb(ev->sender));
+        irc_add_message(conn, channel, ev->message);
+        ev->message = NULL;
+        break;
+    case IRC_EVENT_TOPIC:
+        free_string_builder(&channel->topic);
+        channel->topic = ev->text;
+        ev->text = (StringBuilder){0};
+        break;
+    case IRC_EVENT_LIST:
+        directory_append(&conn->directory, ev->directory);
+        break;
+    case IRC_EVENT_ISUPPORT:
+        if (sv_equal(sv_from_sb(ev->target), "CASEMAPPING")) {
+            channels_set_casemapping(&conn->channels, parse_casemapping(sv_from_sb(ev->text)));
+            members_sort(conn);
+        } else if (sv_equal(sv_from_sb(ev->target), "CHATHISTORY")) {
+            conn->chathistory_limit = parse_count(sv_from_sb(ev->text));
+        }
+        break;
+    case IRC_EVENT_CAPS:
+        conn->caps |= parse_caps(sv_from_sb(ev->text));
+        break;
+    case IRC_EVENT_HISTORY:
+        if (channel == NULL)
+            break;
+        channel->backlog_pending = false;
+        if (ev->history->len == 0)
+            channel->backlog_exhausted = true;
+        // the page is oldest first, the backlog newest first
+        for (size_t i = ev->history->len; i-- > 0;) {
+            HistoryLine *line = &ev->history->data[i];
+            line->message->sender = intern(&conn->senders, sv_from_sb(line->sender));
+            da_append(channel->backlog, line->message);
+            line->message = NULL;
+        }
+        break;
+    case IRC_EVENT_NAMES:
+        members_names(conn, channel, sv_from_sb(ev->text));
+        break;
+    case IRC_EVENT_END_OF_NAMES:
+        members_end_of_names(conn, channel);
+        break;
+    case IRC_EVENT_PART: {
+        uint32_t nick = intern(&conn->senders, sv_from_sb(ev->sender));
+        if (nick == intern(&conn->senders, sv_from_sb(conn->nick))) {
+            channels_set_joined(&conn->channels, channel, false);
+            members_clear(conn, channel);
         } else {
-            parse_str_message(from);
+            members_part(conn, channel, nick);
+        }
+    } break;
+    case IRC_EVENT_QUIT:
+        members_quit(conn, intern(&conn->senders, sv_from_sb(ev->sender)));
+        break;
+    case IRC_EVENT_NICK: {
+        uint32_t from = intern(&conn->senders, sv_from_sb(ev->sender));
+        uint32_t to = intern(&conn->senders, sv_from_sb(ev->text));
+        if (from == intern(&conn->senders, sv_from_sb(conn->nick))) {
+            free_string_builder(&conn->nick);
+            conn->nick = ev->text;
+            ev->text = (StringBuilder){0};
         }
+        members_rename(conn, from, to);
+    } break;
+    case IRC_EVENT_STATUS:
+        free_string_builder(&conn->status);
+        conn->status = ev->text;
+        ev->text = (StringBuilder){0};
+        if (conn->status.len > 0)
+            irc_add_message(conn, NULL, message_new(MESSAGE_CLIENT, 0, sv_from_sb(conn->status)));
+        break;
+    case IRC_EVENT_REGISTERED: {
+        conn->connected = true;
+        // channels that were joined before the connection dropped or picked
+        // while it was down, the network thread packs them into as few JOIN
+        // lines as it can. It is sent even without any channels, PRIVMSGs
+        // typed while reconnecting wait for it.
+        IrcCommand cmd = {.kind = IRC_COMMAND_JOIN, .socket = conn->socket};
+        for (size_t i = 0; i < conn->channels.len; i++) {
+            Channel *c = conn->channels.data[i];
+            if (!c->joined && !c->join_pending)
+                continue;
+            if (cmd.target.len > 0)
+                da_append(cmd.target, ',');
+            da_append_many(cmd.target, c->name.data, c->name.len);
+        }
+        while (spsc_full(commands) && atomic_load(&network_running))
+            ;
+        push_command(cmd);
+    } break;
+    case IRC_EVENT_LAG:
+        conn->lag_ms = strtoll(ev->text.data, NULL, 10);
+        break;
+    case IRC_EVENT_DISCONNECTED:
+        conn->connected = false;
+        conn->caps = 0;
+        conn->lag_ms = -1;
+        free_string_builder(&conn->status);
+        conn->status = sb_from_sv(sv_from_cstr("Disconnected"));
+        // `joined` and `join_pending` stay set, those are joined again after
+        // reconnecting
+        for (size_t i = 0; i < conn->channels.len; i++)
+            members_clear(conn, conn->channels.data[i]);
+        // the answers are not coming anymore
+        for (size_t i = 0; i < conn->channels.len; i++)
+            conn->channels.data[i]->backlog_pending = false;
+        // neither are the echoes, the texts are kept as client messages so
+        // they can be sent again
+        for (size_t i = 0; i < conn->channels.len; i++)
+            drop_unechoed(conn, conn->channels.data[i]);
+        // the rest of an unfinished LIST is lost, the one sent after
+        // registering again starts over
+        if (!conn->directory.complete)
+            directory_clear(&conn->directory);
+        irc_add_message(conn, NULL, message_new(MESSAGE_CLIENT, 0, sv_from_cstr("Disconnected")));
+        break;
+    }
+done:
+    free_event(ev);
+}
+
+Log *irc_log(IrcConnection *conn, Channel *channel) {
+    Log *log = channel != NULL ? &channel->log : &conn->system_log;
+    if (log->opened)
+        return log;
+    // channel names always start with a prefix like #, so they can not clash
+    // with the server log
+    StringView name = sv_from_cstr("server");
+    StringBuilder folded = {0};
+    if (channel != NULL) {
+        for (size_t i = 0; i < channel->name.len; i++)
+            da_append(folded, casefold(conn->channels.casemapping, channel->name.data[i]));
+        name = sv_from_sb(folded);
+    }
+    log_open(log, sv_from_sb(conn->server), name);
+    free(folded.data);
+    return log;
+}
+
+// Whether the text has our nick in it as a word of its own
+static bool mentions(IrcConnection *conn, const Message *msg) {
+    StringView nick = sv_from_sb(conn->nick);
+    if (nick.len == 0)
+        return false;
+    CaseMapping mapping = conn->channels.casemapping;
+    for (size_t i = 0; i + nick.len <= msg->len; i++) {
+        if (i > 0 && (isalnum((unsigned char)msg->text[i - 1]) || msg->text[i - 1] == '_'))
+            continue;
+        size_t end = i + nick.len;
+        if (end < msg->len && (isalnum((unsigned char)msg->text[end]) || msg->text[end] == '_'))
+            continue;
+        if (casefold_equal(mapping, (StringView){.data = msg->text + i, .len = nick.len}, nick))
+            return true;
+    }
+    return false;
+}
+
+void irc_add_message(IrcConnection *conn, Channel *channel, Message *msg) {
+    log_append(irc_log(conn, channel), msg, interned(&conn->senders, msg->sender));
+    if (channel != NULL && msg->type == MESSAGE_NORMAL) {
+        bool shown = current_connection != -1 && connections.data[current_connection] == conn &&
+                     current_channel != -1 && conn->channels.data[current_channel] == channel;
+        if (!shown && msg->sender != intern(&conn->senders, sv_from_sb(conn->nick))) {
+            channel->unread++;
+            if (mentions(conn, msg))
+                channel->highlights++;
+        }
+        channels_touch(&conn->channels, channel);
+    }
+    messages_append(channel != NULL ? &channel->messages : &conn->system_messages, msg);
+    search_add(conn, channel, msg);
+    latency_received(msg);
+}
+
+bool irc_proccess(void) {
+    atomic_store(&ui_woken, false);
+    bool changed = false;
+    while (!spsc_empty(events)) {
+        apply_event(&spsc_front(events));
+        spsc_pop(events);
+        changed = true;
+    }
+    logs_flush();
+    return changed;
+}
+
+void irc_set_wakeup(void (*wakeup)(void)) {
+    wake_ui = wakeup;
+}
+
+static void start_network_thread(void) {
+    if (atomic_load(&network_running))
+        return;
+    if (pipe(wake_fds) < 0)
+        TODO("handle pipe failure properly");
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+    // a closed socket is noticed by writev returning EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    atomic_store(&network_running, true);
+    if (pthread_create(&network_thread, NULL, irc_network_loop, NULL) != 0)
+        TODO("handle pthread_create failure properly");
+}
+
+// "host", "host:port" or "[v6 address]:port"
+static void split_server(StringView server, StringView *host, StringView *port) {
+    *host = server;
+    *port = no_target;
+    const char *colon = NULL;
+    if (server.len > 0 && server.data[0] == '[') {
+        const char *bracket = memchr(server.data, ']', server.len);
+        if (bracket == NULL)
+            return;
+        *host = (StringView){.data = server.data + 1, .len = bracket - server.data - 1};
+        if (bracket + 1 < server.data + server.len && bracket[1] == ':')
+            colon = bracket + 1;
+    } else {
+        colon = memchr(server.data, ':', server.len);
+        // a bare v6 address
+        if (colon != NULL && memchr(colon + 1, ':', server.data + server.len - colon - 1) != NULL)
+            return;
+        if (colon != NULL)
+            host->len = colon - server.data;
+    }
+    if (colon != NULL)
+        *port = (StringView){.data = colon + 1, .len = server.data + server.len - colon - 1};
+}
+
+IrcConnection *irc_connect(StringBuilder *server, StringBuilder *username) {
+    StringView host, port;
+    split_server(sv_from_sb(*server), &host, &port);
+    if (port.len == 0)
+        port = sv_from_cstr(tls_config.enabled ? "6697" : "6667");
+    if (tls_config.enabled && !tls_init())
+        TODO("handle TLS initialization failure properly");
+
+    IrcConnection *conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL);
+    // the port is left out, so the logs stay the same no matter how we connect
+    conn->server = sb_from_sv(host);
+    conn->nick = sb_from_sv(sv_from_sb(*username));
+    // set once the server has registered us, see IRC_EVENT_REGISTERED
+    conn->connected = false;
+    conn->lag_ms = -1;
+    da_append(connections, conn);
+
+    // Resolving and connecting happen on the network side, see connect_step.
+    // The socket is not shared with the network thread yet, so the
+    // registration can be queued right here.
+    IrcSocket *s = new_socket(conn, -1);
+    s->host = sb_from_sv(host).data;
+    s->port = sb_from_sv(port).data;
+    s->nick = sb_from_sv(sv_from_sb(conn->nick)).data;
+    s->connecting = true;
+    conn->socket = s;
+    queue_registration(s);
+
+    start_network_thread();
+    while (!push_command((IrcCommand){.kind = IRC_COMMAND_CONNECT, .socket = s}))
+        sched_yield();
+    return conn;
+}
+
+void irc_replay(IrcConnection *conn, int fd, IrcReplayStats *stats) {
+    IrcSocket *s = new_socket(conn, fd);
+    conn->socket = s;
+    // the same loop as the network thread, minus poll, with the UI side
+    // catching up whenever the event queue is full
+    while (s->fd != -1 || !spsc_empty(events)) {
+        if (s->fd != -1)
+            irc_read_lines(s);
+        irc_proccess();
     }
+    stats->bytes = s->lex.bytes;
+    stats->lines = s->lex.lines;
+    conn->socket = NULL;
+    free_socket(s);
 }
 
 void irc_destroy(void) {
-    for (size_t i = 0; i < channels.len; i++) {
-        Channel *channel = &channels.data[i];
-        free_channel(channel);
+    // whatever the UI did not get to
+    while (!spsc_empty(events)) {
+        free_event(&spsc_front(events));
+        spsc_pop(events);
+    }
+    search_free();
+    for (size_t i = 0; i < connections.len; i++) {
+        IrcConnection *conn = connections.data[i];
+        channels_free(&conn->channels);
+        directory_free(&conn->directory);
+        memberships_free(conn);
+        free_messages(&conn->system_messages);
+        log_close(&conn->system_log);
+        free_interner(&conn->senders);
+        free_string_builder(&conn->server);
+        free_string_builder(&conn->nick);
+        free_string_builder(&conn->status);
+        free(conn);
     }
-   free_messages(&system_messages);
+    free(connections.data);
+    connections = (IrcConnections){0};
 }
 
 void irc_close(void) {
-    if (server_fd != -1)
-        close(server_fd);
+    bool was_running = atomic_exchange(&network_running, false);
+    if (was_running) {
+        wake_network_thread();
+        pthread_join(network_thread, NULL);
+    }
+    // commands the network thread did not get to, including sockets it was
+    // never handed
+    while (!spsc_empty(commands)) {
+        IrcCommand *cmd = &spsc_front(commands);
+        if (cmd->kind == IRC_COMMAND_CONNECT)
+            da_append(sockets, cmd->socket);
+        free_string_builder(&cmd->target);
+        free_string_builder(&cmd->text);
+        spsc_pop(commands);
+    }
+    for (size_t i = 0; i < sockets.len; i++)
+        free_socket(sockets.data[i]);
+    free(sockets.data);
+    sockets.data = NULL;
+    sockets.len = sockets.cap = 0;
+    // resolvers still running were abandoned above and no longer write to it
+    if (was_running) {
+        close(wake_fds[0]);
+        close(wake_fds[1]);
+    }
+    for (size_t i = 0; i < tls_sessions.len; i++) {
+        free(tls_sessions.data[i].host);
+        free(tls_sessions.data[i].port);
+        SSL_SESSION_free(tls_sessions.data[i].session);
+    }
+    free(tls_sessions.data);
+    tls_sessions.data = NULL;
+    tls_sessions.len = tls_sessions.cap = 0;
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
+
+bool irc_join_channel(IrcConnection *conn, StringBuilder *channel) {
+    IrcCommand cmd = {.kind = IRC_COMMAND_JOIN, .socket = conn->socket};
+    cmd.target = sb_from_sv(sv_from_sb(*channel));
+    return push_command(cmd);
+}
+
+bool irc_request_history(IrcConnection *conn, Channel *channel) {
+    if ((conn->caps & CAP_CHATHISTORY) == 0 || !conn->connected || !channel->joined ||
+        channel->backlog_pending || channel->backlog_exhausted)
+        return false;
+    // older than anything we have, whether it is from the server, the log or
+    // the scrollback
+    int64_t oldest = now_ms();
+    Log *log = irc_log(conn, channel);
+    if (channel->backlog.len > 0)
+        oldest = da_last(channel->backlog)->timestamp;
+    else if (log_map(log, 1))
+        oldest = log->index[0].timestamp;
+    else if (channel->messages.len > 0)
+        oldest = messages_get(&channel->messages, 0)->timestamp;
+    uint32_t limit = CHATHISTORY_PAGE;
+    if (conn->chathistory_limit > 0 && conn->chathistory_limit < limit)
+        limit = conn->chathistory_limit;
+    time_t seconds = oldest / 1000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char text[64];
+    snprintf(text, sizeof(text), "timestamp=%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %u",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (int)(oldest % 1000), limit);
+    IrcCommand cmd = {.kind = IRC_COMMAND_CHATHISTORY, .socket = conn->socket};
+    cmd.target = sb_from_sv(sv_from_sb(channel->name));
+    cmd.text = sb_from_sv(sv_from_cstr(text));
+    if (!push_command(cmd))
+        return false;
+    channel->backlog_pending = true;
+    return true;
+}
+
+bool irc_send_message(IrcConnection *conn, StringBuilder *message, StringBuilder *channel) {
+    IrcCommand cmd = {.kind = IRC_COMMAND_PRIVMSG, .socket = conn->socket};
+    cmd.target = sb_from_sv(sv_from_sb(*channel));
+    cmd.text = sb_from_sv(sv_from_sb(*message));
+    return push_command(cmd);
+}
+
+void irc_set_flood_control(double lines_per_second, int burst) {
+    flood_control.lines_per_second = lines_per_second;
+    flood_control.burst = burst > 0 ? burst : 1;
 }
 
-void irc_join_channel(StringBuilder *channel) {
-    dprintf(server_fd, "JOIN %.*s\r\n", (int)channel->len, channel->data);
+void irc_set_tls(bool enabled, bool verify, const char *ca_file) {
+    tls_config.enabled = enabled;
+    tls_config.verify = verify;
+    tls_config.ca_file = ca_file;
 }
 
-void irc_send_message(StringBuilder *message, StringBuilder *channel) {
-    dprintf(server_fd, "PRIVMSG %.*s :%.*s\r\n",
-            (int)channel->len, channel->data,
-            (int)message->len, message->data);
+size_t irc_lines_parsed(void) {
+    return atomic_load_explicit(&lines_parsed, memory_order_relaxed);
 }
@@ -1,44 +1,465 @@
 #ifndef IRC_H
 #define IRC_H
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
     char *data;
     size_t len, cap;
 } StringBuilder;
 
+// Non-owning slice of some other buffer
 typedef struct {
-    StringBuilder sender;
-    StringBuilder text;
-    // TODO add message types (ie normal message, error, server info, etc)
+    const char *data;
+    size_t len;
+} StringView;
+
+// Maps strings to small ids and back, every distinct string is stored once.
+// Id 0 is always the empty string. Views returned by `interned` are only valid
+// until the next call to `intern`.
+typedef struct {
+    // interned strings back to back, each followed by a NUL
+    struct {
+        char *data;
+        size_t len, cap;
+    } chars;
+    // id -> offset into chars
+    struct {
+        uint32_t *data;
+        size_t len, cap;
+    } offsets;
+    // open addressing table of id + 1, 0 marks a free slot
+    uint32_t *slots;
+    size_t slot_count;
+} Interner;
+
+uint32_t intern(Interner *in, StringView sv);
+StringView interned(const Interner *in, uint32_t id);
+void free_interner(Interner *in);
+
+typedef enum {
+    MESSAGE_NORMAL,
+    // somebody joined the channel, there is no text
+    MESSAGE_JOIN,
+    // numeric replies from the server
+    MESSAGE_SERVER,
+    // generated by toki itself, e.g. connection status
+    MESSAGE_CLIENT,
+} MessageType;
+
+// A message and its text live in a single allocation, see message_new
+typedef struct {
+    // unix time in milliseconds
+    int64_t timestamp;
+    // id in the senders table of the connection
+    uint32_t sender;
+    uint32_t len;
+    uint8_t type;
+    // NUL terminated
+    char text[];
 } Message;
 
+// Scrollback is stored in fixed chunks of message pointers so that dropping
+// old lines never moves the rest, see scrollback.c
+#define MESSAGE_CHUNK 256
+
+typedef struct {
+    Message *lines[MESSAGE_CHUNK];
+} MessageChunk;
+
+typedef struct Messages Messages;
+struct Messages {
+    struct {
+        MessageChunk **data;
+        size_t len, cap;
+    } chunks;
+    // chunks before chunk_head are already freed
+    size_t chunk_head;
+    // index of the oldest line in chunks.data[chunk_head]
+    size_t first;
+    size_t len;
+    // lines evicted so far, dropped + i is a stable index of line i
+    size_t dropped;
+    // bytes taken by the messages themselves
+    size_t bytes;
+    // position in the least recently viewed list
+    Messages *lru_prev, *lru_next;
+};
+
+typedef struct {
+    int64_t timestamp;
+    // of the line in the .log file
+    uint64_t offset;
+} LogEntry;
+
+typedef struct {
+    int64_t timestamp;
+    MessageType type;
+    // empty for messages without a sender
+    StringView sender;
+    StringView text;
+} LogLine;
+
+// Append-only on-disk history of one scrollback, see log.c. Lines before
+// `mapped` can be read with log_line without loading the rest of the file.
 typedef struct {
-    Message *data;
+    bool opened;
+    bool dirty;
+    int fd, index_fd;
+    // lines in the log, including the ones not written yet
+    size_t count;
+    size_t flushed;
+    // lines that were already there when the log was opened
+    size_t session_start;
+    // size of the log file, including the pending lines
+    size_t size;
+    size_t flushed_size;
+    StringBuilder pending;
+    struct {
+        LogEntry *data;
+        size_t len, cap;
+    } pending_index;
+    const char *map;
+    size_t map_size;
+    const LogEntry *index;
+    size_t mapped;
+} Log;
+
+// Opens or creates the log `name` of `network`, on failure everything
+// appended to it is dropped
+bool log_open(Log *log, StringView network, StringView name);
+void log_append(Log *log, const Message *msg, StringView sender);
+void log_flush(Log *log);
+// Writes out the pending lines of every log
+void logs_flush(void);
+// Makes the first `count` lines readable with log_line
+bool log_map(Log *log, size_t count);
+bool log_line(const Log *log, size_t i, LogLine *line);
+// Index of the first mapped line sent at or after `timestamp`
+size_t log_find_time(const Log *log, int64_t timestamp);
+void log_close(Log *log);
+
+typedef struct {
+    // id in the senders table of the connection
+    uint32_t nick;
+    // highest channel status like '@' or '+', 0 for none
+    char prefix;
+} Member;
+
+typedef struct {
+    Member *data;
     size_t len, cap;
-} Messages;
+} Members;
 
 typedef struct {
     StringBuilder name;
     StringBuilder topic;
     Messages messages;
+    // sorted by casefolded nick, see members.c
+    Members members;
+    // RPL_NAMREPLY entries until RPL_ENDOFNAMES replaces members with them
+    Members names_pending;
+    Log log;
+    // lines of the log shown above the messages
+    size_t history;
+    // older lines fetched with CHATHISTORY, newest first. They are only kept
+    // in memory, the log already starts after them.
+    struct {
+        Message **data;
+        size_t len, cap;
+    } backlog;
+    // a CHATHISTORY request is on its way
+    bool backlog_pending;
+    // the server has nothing older
+    bool backlog_exhausted;
+    // texts we sent that the server did not echo back yet, see echo-message
+    struct {
+        StringBuilder *data;
+        size_t len, cap;
+    } unechoed;
+    // messages that came in while the channel was not shown, and how many of
+    // those mention our nick
+    uint32_t unread;
+    uint32_t highlights;
+    // position in Channels.sidebar
+    size_t sidebar_index;
     bool joined;
+    // our JOIN is on its way, `joined` is only set by the server's answer
+    bool join_pending;
 } Channel;
 
+typedef enum {
+    // the default until RPL_ISUPPORT says otherwise
+    CASEMAPPING_RFC1459,
+    CASEMAPPING_STRICT_RFC1459,
+    CASEMAPPING_ASCII,
+} CaseMapping;
+
+char casefold(CaseMapping mapping, char c);
+bool casefold_equal(CaseMapping mapping, StringView a, StringView b);
+CaseMapping parse_casemapping(StringView value);
+
+// Channels in the order they were added, indexed by their casefolded name.
+// Channel pointers stay valid until channels_free.
 typedef struct {
-    Channel *data;
+    Channel **data;
     size_t len, cap;
+    struct {
+        Channel **data;
+        size_t len, cap;
+    } chunks;
+    // open addressing table of index into data + 1, 0 marks a free slot
+    uint32_t *slots;
+    size_t slot_count;
+    CaseMapping casemapping;
+    // the order of the sidebar: the first `sidebar_joined` channels are joined
+    // ones, most recently active first, the rest follow. Kept up to date by
+    // moving single entries, see channels_touch.
+    struct {
+        Channel **data;
+        size_t len, cap;
+    } sidebar;
+    size_t sidebar_joined;
 } Channels;
 
-void irc_proccess(void);
+Channel *channels_find(Channels *channels, StringView name);
+// Returns the existing channel if there already is one with that name
+Channel *channels_add(Channels *channels, StringView name);
+void channels_set_casemapping(Channels *channels, CaseMapping mapping);
+// Use this instead of setting Channel.joined so the sidebar order follows
+void channels_set_joined(Channels *channels, Channel *channel, bool joined);
+// Moves a joined channel to the top of the sidebar after a message
+void channels_touch(Channels *channels, Channel *channel);
+void channels_free(Channels *channels);
+
+typedef enum {
+    DIRECTORY_SORT_USERS,
+    DIRECTORY_SORT_NAME,
+} DirectorySort;
+
+// Channels from LIST, kept apart from Channels since there can be tens of
+// thousands of them. Every column is its own array and the strings live in a
+// single buffer.
+typedef struct {
+    // NUL terminated names and topics back to back
+    StringBuilder chars;
+    // offsets into chars
+    struct {
+        uint32_t *data;
+        size_t len, cap;
+    } names, topics;
+    struct {
+        uint32_t *data;
+        size_t len, cap;
+    } users;
+    // indices of the entries with at least min_users users in `sort` order,
+    // see directory_update_view
+    struct {
+        uint32_t *data;
+        size_t len, cap;
+    } view;
+    DirectorySort sort;
+    uint32_t min_users;
+    // the view is out of date
+    bool dirty;
+    // RPL_LISTEND was received
+    bool complete;
+} ChannelDirectory;
+
+void directory_add(ChannelDirectory *dir, StringView name, uint32_t users, StringView topic);
+// Forgets the entries, keeping the sort order and filter
+void directory_clear(ChannelDirectory *dir);
+// Appends the entries of a batch parsed by the network thread
+void directory_append(ChannelDirectory *dir, const ChannelDirectory *batch);
+StringView directory_name(const ChannelDirectory *dir, size_t i);
+StringView directory_topic(const ChannelDirectory *dir, size_t i);
+void directory_update_view(ChannelDirectory *dir);
+void directory_free(ChannelDirectory *dir);
+
+typedef struct IrcSocket IrcSocket;
+
+// IRCv3 capabilities toki knows how to use
+typedef enum {
+    CAP_MESSAGE_TAGS = 1 << 0,
+    CAP_SERVER_TIME  = 1 << 1,
+    CAP_BATCH        = 1 << 2,
+    CAP_ECHO_MESSAGE = 1 << 3,
+    CAP_CHATHISTORY  = 1 << 4,
+} IrcCap;
+
+typedef struct {
+    Channel **data;
+    size_t len, cap;
+} ChannelRefs;
+
+// One server connection. Everything in here belongs to the UI thread, the
+// network thread only works with `socket`.
+typedef struct {
+    StringBuilder server;
+    StringBuilder nick;
+    // nicknames of everyone who sent a message, see Message.sender
+    Interner senders;
+    Channels channels;
+    ChannelDirectory directory;
+    // nick id -> channels that nick is in
+    struct {
+        ChannelRefs *data;
+        size_t len, cap;
+    } memberships;
+    Messages system_messages;
+    Log system_log;
+    size_t system_history;
+    // progress of connecting, empty once registered
+    StringBuilder status;
+    // IrcCap flags the server acknowledged
+    uint32_t caps;
+    // most lines one CHATHISTORY request may ask for
+    uint32_t chathistory_limit;
+    // round trip of the last lag PING in milliseconds, -1 until one came back
+    int64_t lag_ms;
+    bool connected;
+    IrcSocket *socket;
+} IrcConnection;
+
+typedef struct {
+    IrcConnection **data;
+    size_t len, cap;
+} IrcConnections;
+
+void members_join(IrcConnection *conn, Channel *channel, uint32_t nick, char prefix);
+void members_part(IrcConnection *conn, Channel *channel, uint32_t nick);
+// Removes nick from every channel it is in
+void members_quit(IrcConnection *conn, uint32_t nick);
+void members_rename(IrcConnection *conn, uint32_t from, uint32_t to);
+// Collects one RPL_NAMREPLY list of (prefixed) nicks
+void members_names(IrcConnection *conn, Channel *channel, StringView names);
+void members_end_of_names(IrcConnection *conn, Channel *channel);
+// Restores the order of every member list after the casemapping changed
+void members_sort(IrcConnection *conn);
+void members_clear(IrcConnection *conn, Channel *channel);
+void memberships_free(IrcConnection *conn);
+
+Message *message_new(MessageType type, uint32_t sender, StringView text);
+// Takes ownership of msg, old lines of this or other scrollbacks may be freed
+// to stay within the limits. Messages must not move after the first append.
+void messages_append(Messages *msgs, Message *msg);
+Message *messages_get(const Messages *msgs, size_t i);
+// Marks the scrollback as the most recently viewed one, the least recently
+// viewed ones are the first to lose lines when over the memory budget
+void messages_viewed(Messages *msgs);
+void free_messages(Messages *msgs);
+// At most `max_lines` lines per scrollback and `budget` bytes of messages in
+// total. The newest chunk of a scrollback is kept even over the budget.
+void scrollback_set_limits(size_t max_lines, size_t budget);
+typedef struct {
+    IrcConnection *conn;
+    // NULL for the server messages
+    Channel *channel;
+    // dropped + index in the Messages, see Messages.dropped
+    size_t line;
+} SearchHit;
+
+typedef struct {
+    SearchHit *data;
+    size_t len, cap;
+} SearchHits;
+
+// Indexes the line that was just appended to the scrollback of channel
+void search_add(IrcConnection *conn, Channel *channel, const Message *msg);
+// Starts a case insensitive substring search over everything still in the
+// scrollback, dropping the one before. The newest `max` hits end up in hits,
+// newest first, over the calls to search_step.
+void search_start(StringView query, SearchHits *hits, size_t max);
+// Goes on with the search, looking at no more than `budget` lines, including
+// the ones indexed since it started. True once hits is complete.
+bool search_step(SearchHits *hits, size_t budget);
+void search_free(void);
+
+// Where the time of one frame went, see stats.c
+typedef struct {
+    // from starting the frame until it was presented
+    float frame_ms;
+    float layout_ms, render_ms, process_ms;
+    uint32_t quads, glyphs, draw_calls;
+    // glyphs of retained text that had to be generated and uploaded
+    uint32_t uploaded_glyphs;
+} FrameStats;
+
+typedef struct {
+    // frames in the window the rest is about
+    size_t frames;
+    float frame_p50, frame_p90, frame_p99, frame_max;
+    // means over the window
+    float layout_ms, render_ms, process_ms;
+    float quads, glyphs, draw_calls, uploaded_glyphs;
+    double lines_per_second;
+} StatsSummary;
+
+// Monotonic milliseconds to time frames with
+double stats_now_ms(void);
+// Records a frame. Cheap enough to call on every frame, the summaries are
+// only computed when asked for.
+void stats_frame(const FrameStats *frame);
+// Over the last few seconds of frames
+void stats_summary(StatsSummary *summary);
+
+// Latency of the messages of toki-mockd from being sent to being on screen,
+// only measured when TOKI_LATENCY is set, see latency.c
+void latency_received(const Message *msg);
+// Call once the frame is presented
+void latency_rendered(void);
+// Prints the percentiles of the whole session
+void latency_report(void);
+
+// Log of the channel or of the server messages if channel is NULL, it is
+// opened on first use
+Log *irc_log(IrcConnection *conn, Channel *channel);
+// Appends msg to the scrollback and the log of the channel, or of the server
+// messages if channel is NULL
+void irc_add_message(IrcConnection *conn, Channel *channel, Message *msg);
+
+// Applies what the network thread sent over, returns whether there was
+// anything so the UI knows it has to redraw
+bool irc_proccess(void);
+// wakeup is called from the network thread when new events are waiting, at
+// most once between two irc_proccess calls. Set it before connecting.
+void irc_set_wakeup(void (*wakeup)(void));
 void irc_close(void);
-void irc_connect(StringBuilder *server, StringBuilder *username);
-void irc_send_message(StringBuilder *message, StringBuilder *channel);
-void irc_join_channel(StringBuilder *channel);
+// server is "host[:port]", the port defaults to 6697 with TLS and 6667
+// without. Returns right away, resolving and connecting happen on the
+// network thread and are reported in IrcConnection.status.
+IrcConnection *irc_connect(StringBuilder *server, StringBuilder *username);
+// Both return false when the command could not be queued right now
+bool irc_send_message(IrcConnection *conn, StringBuilder *message, StringBuilder *channel);
+bool irc_join_channel(IrcConnection *conn, StringBuilder *channel);
+// Asks the server for the page of history before the oldest line we have of
+// channel. Does nothing while a request is pending, when the server has no
+// more history or does not support chathistory.
+bool irc_request_history(IrcConnection *conn, Channel *channel);
+// Outgoing lines are limited to `lines_per_second` after an initial burst of
+// `burst` lines, a rate of 0 turns the limit off. PING replies are never
+// delayed. Call before irc_connect.
+void irc_set_flood_control(double lines_per_second, int burst);
+// TLS is on and the certificate is checked against the system CAs and
+// `ca_file` (may be NULL) unless told otherwise. Call before irc_connect.
+void irc_set_tls(bool enabled, bool verify, const char *ca_file);
+// Lines the network thread parsed so far, over all connections
+size_t irc_lines_parsed(void);
 void irc_destroy(void);
 
-extern Messages system_messages;
-extern Channels channels;
+typedef struct {
+    size_t bytes;
+    size_t lines;
+} IrcReplayStats;
+
+// Runs recorded server traffic from fd through the parser and applies the
+// events right away on the calling thread, no network thread involved. For
+// benchmarks, fd is closed once it reaches end of file.
+void irc_replay(IrcConnection *conn, int fd, IrcReplayStats *stats);
+
+extern IrcConnections connections;
+// -1 for the system messages of the current connection
 extern int current_channel;
+extern int current_connection;
 
 #endif
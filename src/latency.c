@@ -0,0 +1,134 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Receive-to-render latency of the traffic of toki-mockd, see mockd.c. Each
+// of its messages carries the time it was sent, once the frame after the
+// message was applied is on screen the difference goes into a histogram.
+// Percentiles are printed to stderr every few seconds and on exit.
+
+#define REPORT_INTERVAL_US 5000000
+// exact below 64 us, then 32 buckets per power of two, about 3% wide
+#define EXACT_BUCKETS 64
+#define SUB_BUCKETS 32
+#define BUCKETS (EXACT_BUCKETS + (64 - 6) * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static struct {
+    // -1 until TOKI_LATENCY was looked at
+    int enabled;
+    // send times of the messages applied since the last frame
+    struct {
+        int64_t *data;
+        size_t len, cap;
+    } pending;
+    Histogram window, all;
+    int64_t window_start;
+} latency = {.enabled = -1};
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool enabled(void) {
+    if (latency.enabled < 0) {
+        const char *env = getenv("TOKI_LATENCY");
+        latency.enabled = env != NULL && strcmp(env, "0") != 0;
+    }
+    return latency.enabled;
+}
+
+static size_t bucket_of(uint64_t us) {
+    if (us < EXACT_BUCKETS)
+        return us;
+    int msb = 63 - __builtin_clzll(us);
+    size_t sub = (us >> (msb - 5)) & (SUB_BUCKETS - 1);
+    return EXACT_BUCKETS + (msb - 6) * SUB_BUCKETS + sub;
+}
+
+// Lower end of a bucket
+static uint64_t bucket_value(size_t bucket) {
+    if (bucket < EXACT_BUCKETS)
+        return bucket;
+    size_t msb = (bucket - EXACT_BUCKETS) / SUB_BUCKETS + 6;
+    uint64_t sub = (bucket - EXACT_BUCKETS) % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub) << (msb - 5);
+}
+
+static void record(Histogram *h, uint64_t us) {
+    h->counts[bucket_of(us)]++;
+    h->total++;
+    if (us > h->max)
+        h->max = us;
+}
+
+static uint64_t percentile(const Histogram *h, double p) {
+    uint64_t rank = (uint64_t)(p * (h->total - 1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return bucket_value(i);
+    }
+    return h->max;
+}
+
+static void report(const char *what, const Histogram *h) {
+    if (h->total == 0)
+        return;
+    fprintf(stderr, "latency %s: %llu messages, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+            what, (unsigned long long)h->total,
+            percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3,
+            percentile(h, 0.99) / 1e3, percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+void latency_received(const Message *msg) {
+    if (!enabled() || msg->len < 6 || memcmp(msg->text, "mockd:", 6) != 0)
+        return;
+    int64_t sent = 0;
+    for (const char *c = msg->text + 6; *c >= '0' && *c <= '9'; c++)
+        sent = sent * 10 + *c - '0';
+    da_append(latency.pending, sent);
+}
+
+void latency_rendered(void) {
+    if (!enabled())
+        return;
+    int64_t now = now_us();
+    for (size_t i = 0; i < latency.pending.len; i++) {
+        // the clocks of two machines may disagree a bit
+        int64_t us = now - latency.pending.data[i];
+        record(&latency.window, us > 0 ? us : 0);
+        record(&latency.all, us > 0 ? us : 0);
+    }
+    latency.pending.len = 0;
+    if (latency.window_start == 0)
+        latency.window_start = now;
+    if (now - latency.window_start >= REPORT_INTERVAL_US) {
+        report("last 5 s", &latency.window);
+        memset(&latency.window, 0, sizeof(latency.window));
+        latency.window_start = now;
+    }
+}
+
+void latency_report(void) {
+    if (!enabled())
+        return;
+    report("total", &latency.all);
+    free(latency.pending.data);
+    latency.pending.data = NULL;
+    latency.pending.len = latency.pending.cap = 0;
+}
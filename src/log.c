@@ -0,0 +1,285 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Every log is two append-only files, `<name>.log` with one
+// "<timestamp> <type> <sender> <text>\n" line per message and `<name>.idx`
+// with a LogEntry per line. Lines are collected in memory and written in
+// batches by logs_flush.
+
+// pending lines are written right away once there are this many bytes of them
+#define LOG_FLUSH_SIZE (64 * 1024)
+
+static struct {
+    Log **data;
+    size_t len, cap;
+} dirty = {0};
+
+static void path_append(StringBuilder *path, StringView sv) {
+    for (size_t i = 0; i < sv.len; i++) {
+        char c = sv.data[i];
+        // names come from the network, keep them inside the log directory
+        if (c == '/' || c == '\0' || (c == '.' && i == 0))
+            c = '_';
+        da_append(*path, c);
+    }
+}
+
+// Creates every directory leading up to the last '/' of path
+static bool make_dirs(char *path) {
+    for (char *p = path + 1; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        bool failed = mkdir(path, 0700) < 0 && errno != EEXIST;
+        *p = '/';
+        if (failed)
+            return false;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (const char *)data + n;
+        len -= n;
+    }
+    return true;
+}
+
+static void unmap(Log *log) {
+    if (log->map != NULL)
+        munmap((void *)log->map, log->map_size);
+    if (log->index != NULL)
+        munmap((void *)log->index, log->mapped * sizeof(LogEntry));
+    log->map = NULL;
+    log->index = NULL;
+    log->map_size = 0;
+    log->mapped = 0;
+}
+
+static void disable(Log *log) {
+    unmap(log);
+    if (log->fd >= 0)
+        close(log->fd);
+    if (log->index_fd >= 0)
+        close(log->index_fd);
+    log->fd = log->index_fd = -1;
+    log->count = log->flushed;
+    log->pending.len = 0;
+    log->pending_index.len = 0;
+}
+
+// Drops whatever a crash left after the last complete, indexed line
+static bool recover(Log *log) {
+    struct stat st, index_st;
+    if (fstat(log->fd, &st) < 0 || fstat(log->index_fd, &index_st) < 0)
+        return false;
+    size_t count = index_st.st_size / sizeof(LogEntry);
+    size_t size = 0;
+    while (count > 0) {
+        LogEntry last;
+        if (pread(log->index_fd, &last, sizeof(last), (count - 1) * sizeof(LogEntry)) != sizeof(last))
+            return false;
+        char buf[4096];
+        ssize_t n = 0;
+        size_t end = 0;
+        for (size_t at = last.offset; at < (size_t)st.st_size && end == 0; at += n) {
+            n = pread(log->fd, buf, sizeof(buf), at);
+            if (n <= 0)
+                return false;
+            char *newline = memchr(buf, '\n', n);
+            if (newline != NULL)
+                end = at + (newline - buf) + 1;
+        }
+        if (end != 0) {
+            size = end;
+            break;
+        }
+        count--;
+    }
+    if (ftruncate(log->index_fd, count * sizeof(LogEntry)) < 0 || ftruncate(log->fd, size) < 0)
+        return false;
+    log->count = log->flushed = log->session_start = count;
+    log->size = log->flushed_size = size;
+    return true;
+}
+
+bool log_open(Log *log, StringView network, StringView name) {
+    *log = (Log){.opened = true, .fd = -1, .index_fd = -1};
+    StringBuilder path = {0};
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    if (data_home != NULL && data_home[0] == '/') {
+        da_append_many(path, data_home, strlen(data_home));
+    } else if (home != NULL && home[0] == '/') {
+        da_append_many(path, home, strlen(home));
+        da_append_many(path, "/.local/share", 13);
+    } else {
+        return false;
+    }
+    da_append_many(path, "/toki/logs/", 11);
+    path_append(&path, network);
+    da_append(path, '/');
+    path_append(&path, name);
+    da_append_many(path, ".log", 5);
+    bool ok = make_dirs(path.data);
+    if (ok)
+        log->fd = open(path.data, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    memcpy(path.data + path.len - 5, ".idx", 5);
+    if (ok && log->fd >= 0)
+        log->index_fd = open(path.data, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    ok = ok && log->index_fd >= 0 && recover(log);
+    if (!ok) {
+        fprintf(stderr, "could not open log %s: %s\n", path.data, strerror(errno));
+        disable(log);
+    }
+    free(path.data);
+    return ok;
+}
+
+void log_append(Log *log, const Message *msg, StringView sender) {
+    if (log->fd < 0)
+        return;
+    if (sender.len == 0)
+        sender = (StringView){.data = "*", .len = 1};
+    char head[64];
+    int n = snprintf(head, sizeof(head), "%lld %d ", (long long)msg->timestamp, msg->type);
+    size_t start = log->pending.len;
+    da_append_many(log->pending, head, (size_t)n);
+    da_append_many(log->pending, sender.data, sender.len);
+    da_append(log->pending, ' ');
+    da_append_many(log->pending, msg->text, msg->len);
+    da_append(log->pending, '\n');
+    da_append(log->pending_index, ((LogEntry){.timestamp = msg->timestamp, .offset = log->size}));
+    log->size += log->pending.len - start;
+    log->count++;
+    if (!log->dirty) {
+        log->dirty = true;
+        da_append(dirty, log);
+    }
+    if (log->pending.len >= LOG_FLUSH_SIZE)
+        log_flush(log);
+}
+
+void log_flush(Log *log) {
+    if (log->fd < 0 || log->pending_index.len == 0)
+        return;
+    // lines go first, so an index entry never points past the end of the log
+    if (!write_all(log->fd, log->pending.data, log->pending.len) ||
+        !write_all(log->index_fd, log->pending_index.data, log->pending_index.len * sizeof(LogEntry))) {
+        perror("log write");
+        disable(log);
+        return;
+    }
+    log->flushed = log->count;
+    log->flushed_size = log->size;
+    log->pending.len = 0;
+    log->pending_index.len = 0;
+}
+
+void logs_flush(void) {
+    for (size_t i = 0; i < dirty.len; i++) {
+        log_flush(dirty.data[i]);
+        dirty.data[i]->dirty = false;
+    }
+    dirty.len = 0;
+}
+
+bool log_map(Log *log, size_t count) {
+    if (count <= log->mapped)
+        return true;
+    if (count > log->flushed)
+        log_flush(log);
+    if (log->fd < 0 || count > log->flushed)
+        return false;
+    unmap(log);
+    // map everything that is on disk, so this only happens again after the
+    // lines written since then are needed
+    const char *map = mmap(NULL, log->flushed_size, PROT_READ, MAP_SHARED, log->fd, 0);
+    const LogEntry *index = mmap(NULL, log->flushed * sizeof(LogEntry), PROT_READ, MAP_SHARED, log->index_fd, 0);
+    if (map == MAP_FAILED || index == MAP_FAILED) {
+        perror("mmap");
+        if (map != MAP_FAILED)
+            munmap((void *)map, log->flushed_size);
+        if (index != MAP_FAILED)
+            munmap((void *)index, log->flushed * sizeof(LogEntry));
+        return false;
+    }
+    log->map = map;
+    log->map_size = log->flushed_size;
+    log->index = index;
+    log->mapped = log->flushed;
+    return true;
+}
+
+static StringView chop_field(StringView *sv) {
+    const char *space = memchr(sv->data, ' ', sv->len);
+    size_t len = space != NULL ? (size_t)(space - sv->data) : sv->len;
+    StringView field = {.data = sv->data, .len = len};
+    size_t skip = space != NULL ? len + 1 : len;
+    sv->data += skip;
+    sv->len -= skip;
+    return field;
+}
+
+bool log_line(const Log *log, size_t i, LogLine *line) {
+    if (i >= log->mapped)
+        return false;
+    size_t start = log->index[i].offset;
+    size_t end = i + 1 < log->mapped ? log->index[i + 1].offset : log->map_size;
+    if (start >= end || end > log->map_size)
+        return false;
+    // without the newline
+    StringView rest = {.data = log->map + start, .len = end - start - 1};
+    chop_field(&rest);
+    StringView type = chop_field(&rest);
+    line->timestamp = log->index[i].timestamp;
+    line->type = type.len == 1 && '0' <= type.data[0] && type.data[0] <= '9' ? type.data[0] - '0' : MESSAGE_NORMAL;
+    line->sender = chop_field(&rest);
+    if (line->sender.len == 1 && line->sender.data[0] == '*')
+        line->sender.len = 0;
+    line->text = rest;
+    return true;
+}
+
+size_t log_find_time(const Log *log, int64_t timestamp) {
+    size_t lo = 0, hi = log->mapped;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (log->index[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void log_close(Log *log) {
+    log_flush(log);
+    for (size_t i = 0; i < dirty.len; i++) {
+        if (dirty.data[i] == log) {
+            dirty.data[i] = da_last(dirty);
+            dirty.len--;
+            break;
+        }
+    }
+    disable(log);
+    free(log->pending.data);
+    free(log->pending_index.data);
+    *log = (Log){0};
+}
@@ -36,10 +36,11 @@ static inline Clay_Color color_alpha(Clay_Color c, uint8_t alpha) {
 
 #define ARRLEN(xs) (sizeof(xs) / sizeof(*(xs)))
 const int font_size = 24;
+// lines of history loaded from the log at a time
+#define HISTORY_PAGE 100
 
-Messages system_messages = {0};
-
-Channels channels = {0};
+IrcConnections connections = {0};
+int current_connection = -1;
 int current_channel = -1;
 
 enum {
@@ -50,9 +51,56 @@ StringBuilder *current_input = {0};
 
 StringBuilder username = {0}, server = {0}, password = {0};
 StringBuilder the_message = {0};
+StringBuilder search_query = {0};
+// the query search_hits are for
+StringBuilder searched = {0};
+SearchHits search_hits = {0};
+#define SEARCH_MAX_HITS 100
+// lines a frame looks at at most, a longer search goes on in the next frames
+#define SEARCH_FRAME_BUDGET 20000
+// the LIST results of the current connection are shown instead of messages
+bool show_directory = false;
+StringBuilder min_users_input = {0};
+// rendering every entry of a big network would take far too long
+#define DIRECTORY_MAX_ROWS 500
+#define MEMBER_ROW_HEIGHT (font_size + 8)
+// a channel button and the gap below it
+#define SIDEBAR_ROW_HEIGHT 40
+#define SIDEBAR_MAX_ROWS 128
+// search result that was clicked last, it is highlighted and scrolled to
+struct {
+    SearchHit hit;
+    bool scroll;
+} jump = {0};
 
-int server_fd = -1;
 int users_online = 0;
+// what Clay measures text with, messages are wrapped with it in advance
+Stb_FontData *fonts = NULL;
+// performance overlay, toggled with F3
+bool show_hud = false;
+
+// Nothing on screen moves by itself, so frames are only drawn after input,
+// network events or while a scroll container still glides. Clicks are handled
+// while a frame is laid out, the frame after that shows what they changed.
+#define REDRAW_FRAMES 2
+// upper bound for sleeping, in case a wakeup came before the first wait
+#define IDLE_WAIT_MS 1000
+// largest frame delta handed to Clay, e.g. for the first frame after sleeping
+#define MAX_FRAME_DELTA 0.1
+int redraw = REDRAW_FRAMES;
+// scroll positions at the end of the last frame, see scroll_moved
+float scroll_positions[5];
+
+// Text is drawn from signed distance fields baked at this size, which stay
+// sharp at every zoom level and pixel density. TOKI_SDF=0 rasterizes plain
+// glyphs for font_size instead.
+#define SDF_BAKE_SIZE 32
+// Ctrl + and Ctrl - scale the whole interface, Ctrl 0 resets it. Only the
+// layout changes, the glyphs in the atlas serve every zoom level.
+#define ZOOM_STEP 0.1f
+#define MIN_ZOOM 0.5f
+#define MAX_ZOOM 3.0f
+float zoom = 1;
 
 void HandleClayErrors(Clay_ErrorData errorData) {
     printf("%s\n", errorData.errorText.chars);
@@ -112,7 +160,7 @@ void render_login(RGFW_window *win) {
         Clay_ElementId id;
         Clay_String text;
     } inputs[] = {
-        {&server,   CLAY_ID("Server"),   CLAY_STRING("Server IP...")},
+        {&server,   CLAY_ID("Server"),   CLAY_STRING("Server[:port]...")},
         {&username, CLAY_ID("Username"), CLAY_STRING("Username...")},
         {&password, CLAY_ID("Password"), CLAY_STRING("Password...")},
     };
@@ -130,78 +178,812 @@ void render_login(RGFW_window *win) {
         if (render_button(win, CLAY_STRING("Login"), CLAY_SIZING_PERCENT(0.4), CATPPUCCIN_PINK, color_alpha(CATPPUCCIN_PINK, 128), CATPPUCCIN_BASE)) {
             state = STATE_CHAT;
             irc_connect(&server, &username);
+            current_connection = connections.len - 1;
+            current_channel = -1;
+        }
+    }
+}
+
+static void jump_to(const SearchHit *hit) {
+    for (size_t c = 0; c < connections.len; c++) {
+        if (connections.data[c] == hit->conn)
+            current_connection = c;
+    }
+    current_channel = -1;
+    for (size_t i = 0; hit->channel != NULL && i < hit->conn->channels.len; i++) {
+        if (hit->conn->channels.data[i] == hit->channel)
+            current_channel = i;
+    }
+    jump.hit = *hit;
+    jump.scroll = true;
+    show_directory = false;
+}
+
+void render_search(RGFW_window *win) {
+    CLAY_AUTO_ID({.layout = {.sizing.width = CLAY_SIZING_GROW(0), .childGap = 8, .padding = {16, 16, 16, 0}}}) {
+        render_text_input(win, CLAY_SIZING_GROW(0), &search_query, CLAY_ID("Search"), CLAY_STRING("Search..."));
+        if (search_query.len > 0 &&
+            render_button(win, CLAY_STRING(" Clear "), CLAY_SIZING_FIT(0), CATPPUCCIN_SURFACE1, CATPPUCCIN_SURFACE2, CATPPUCCIN_TEXT)) {
+            search_query.len = 0;
         }
     }
+    if (searched.len != search_query.len || memcmp(searched.data, search_query.data, searched.len) != 0) {
+        search_start((StringView){.data = search_query.data, .len = search_query.len}, &search_hits, SEARCH_MAX_HITS);
+        searched.len = 0;
+        da_append_many(searched, search_query.data, search_query.len);
+    }
+    if (search_query.len == 0)
+        return;
+    // also picks up messages that came in since
+    bool complete = search_step(&search_hits, SEARCH_FRAME_BUDGET);
+    if (!complete)
+        redraw = REDRAW_FRAMES;
+    CLAY(CLAY_ID("SearchResults"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                               .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_FIT(0, 240)},
+                                               .padding = CLAY_PADDING_ALL(16),
+                                               .childGap = 3},
+                                    .clip = {.vertical = true, .childOffset = Clay_GetScrollOffset()}}) {
+        if (search_hits.len == 0 && complete)
+            CLAY_TEXT(CLAY_STRING("Nothing found"), CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_SUBTEXT0}));
+        else if (search_hits.len == 0)
+            CLAY_TEXT(CLAY_STRING("Searching..."), CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_SUBTEXT0}));
+        for (size_t i = 0; i < search_hits.len; i++) {
+            SearchHit *hit = &search_hits.data[i];
+            Messages *messages = hit->channel != NULL ? &hit->channel->messages : &hit->conn->system_messages;
+            // evicted since the search
+            if (hit->line < messages->dropped)
+                continue;
+            Message *msg = messages_get(messages, hit->line - messages->dropped);
+            StringBuilder *where = hit->channel != NULL ? &hit->channel->name : &hit->conn->server;
+            Clay_String where_text = {.chars = where->data, .length = where->len};
+            Clay_String text = {.chars = msg->text, .length = msg->len};
+            CLAY_AUTO_ID({.layout = {.childGap = 8, .padding = CLAY_PADDING_ALL(5), .childAlignment.y = CLAY_ALIGN_Y_CENTER},
+                          .backgroundColor = Clay_Hovered() ? CATPPUCCIN_SURFACE1 : CATPPUCCIN_SURFACE0,
+                          .cornerRadius = CLAY_CORNER_RADIUS(8)}) {
+                if (Clay_Hovered()) {
+                    RGFW_window_setMouseStandard(win, RGFW_mousePointingHand);
+                    if (RGFW_window_isMouseDown(win, RGFW_mouseLeft))
+                        jump_to(hit);
+                }
+                CLAY_TEXT(where_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_PINK}));
+                CLAY_TEXT(text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_TEXT}));
+            }
+        }
+    }
+}
+
+// The message list only lays out the rows in view plus a few more, the rest
+// is stood in for by two spacers of estimated height. Rows are numbered like
+// the lines of the log, the CHATHISTORY backlog before it counts down from
+// -1. The view is pinned to a row rather than a pixel offset, so lines that
+// arrive, get evicted or are loaded above do not move what is on screen.
+#define MESSAGE_ROW_GAP 3
+#define MESSAGE_OVERSCAN 4
+#define MESSAGE_MAX_ROWS 256
+// The spacers only have to leave room for one frame of scrolling, since the
+// anchor is moved by how far it went. Longer ones would run out of float
+// precision on big logs.
+#define MESSAGE_SPACER_ROWS 1000
+#define ROW_HEIGHT_CACHE 1024
+#define TEXT_LAYOUT_CACHE 1024
+// padding of the message list, of the sender and the gap after it
+#define MESSAGES_PADDING 16
+#define SENDER_PADDING 5
+#define SENDER_GAP 8
+
+// Consecutive row numbers starting at `first`
+typedef struct {
+    int64_t first;
+    size_t len;
+} RowRange;
+
+// backlog, log, messages and unechoed lines, in that order
+typedef struct {
+    RowRange ranges[4];
+    size_t count;
+} MessageRows;
+
+struct {
+    IrcConnection *conn;
+    Channel *channel;
+    // heights depend on the width through line wrapping
+    float width;
+    // row at the top of the view and how far it is scrolled out of it
+    int64_t anchor;
+    float anchor_offset;
+    // stuck to the newest row
+    bool follow;
+    // scroll position of the last frame, if it was put into the scroll
+    // container. It is shared by all channels.
+    float position;
+    bool placed;
+    // rows laid out in the last frame as MessageRow 0 and up
+    int64_t laid_out[MESSAGE_MAX_ROWS];
+    size_t laid_out_len;
+    // measured heights by row, a height of 0 marks a free slot
+    struct {
+        int64_t row;
+        float height;
+    } heights[ROW_HEIGHT_CACHE];
+    // of a single line row, the smallest height measured so far
+    float estimate;
+    // bumped whenever the text layouts go out of date
+    uint32_t layout_generation;
+} message_view = {0};
+
+// Where the text of a row wraps. Message texts never change, so the lines
+// are found once per row and only again when the width of the list changes,
+// zooming included, instead of Clay wrapping every visible message every frame.
+typedef struct {
+    int64_t row;
+    // of the text, in case the row holds a different one now
+    uint32_t text_len;
+    // message_view.layout_generation this was made for, 0 for a free slot
+    uint32_t generation;
+    float sender_width;
+    // offset and length into the text of every line
+    struct {
+        struct {
+            uint32_t offset, len;
+        } *data;
+        size_t len, cap;
+    } lines;
+} TextLayout;
+
+TextLayout text_layouts[TEXT_LAYOUT_CACHE] = {0};
+
+static void reset_message_view(IrcConnection *conn, Channel *channel) {
+    message_view.conn = conn;
+    message_view.channel = channel;
+    message_view.follow = true;
+    message_view.anchor_offset = 0;
+    message_view.placed = false;
+    message_view.laid_out_len = 0;
+    memset(message_view.heights, 0, sizeof(message_view.heights));
+    // row numbers mean something else in another channel
+    message_view.layout_generation++;
 }
 
-void render_chat(RGFW_window *win) {
+static float text_width(const char *text, size_t len) {
+    Clay_TextElementConfig config = {.fontSize = font_size};
+    Clay_StringSlice slice = {.length = len, .chars = text, .baseChars = text};
+    return Stb_MeasureText(slice, &config, fonts).width;
+}
+
+static void add_line(TextLayout *layout, size_t start, size_t end) {
+    da_reserve(layout->lines, layout->lines.len + 1);
+    layout->lines.data[layout->lines.len].offset = start;
+    layout->lines.data[layout->lines.len].len = end - start;
+    layout->lines.len++;
+}
+
+// The lines of a row the same way Clay would wrap them: at spaces, at
+// newlines and words that are too long get a line of their own. NULL until
+// the width of the message list is known.
+static TextLayout *text_layout(int64_t row, StringView sender, StringView text) {
+    if (message_view.width <= 0 || fonts == NULL)
+        return NULL;
+    TextLayout *layout = &text_layouts[(uint64_t)row % TEXT_LAYOUT_CACHE];
+    if (layout->generation == message_view.layout_generation && layout->row == row && layout->text_len == text.len)
+        return layout;
+    layout->row = row;
+    layout->text_len = text.len;
+    layout->generation = message_view.layout_generation;
+    layout->lines.len = 0;
+    layout->sender_width = text_width(sender.data, sender.len);
+    float max = message_view.width - 2 * MESSAGES_PADDING - (layout->sender_width + 2 * SENDER_PADDING) - SENDER_GAP;
+    float space = text_width(" ", 1);
+    // the line so far ends at line_end, without the spaces after it
+    size_t line = 0, line_end = 0, i = 0;
+    float width = 0;
+    while (i < text.len) {
+        if (text.data[i] == '\n') {
+            add_line(layout, line, line_end);
+            line = line_end = ++i;
+            width = 0;
+            continue;
+        }
+        if (text.data[i] == ' ') {
+            i++;
+            continue;
+        }
+        size_t word = i;
+        while (i < text.len && text.data[i] != ' ' && text.data[i] != '\n')
+            i++;
+        float word_width = text_width(text.data + word, i - word);
+        float spaces = (word - line_end) * space;
+        if (line_end > line && width + spaces + word_width > max) {
+            add_line(layout, line, line_end);
+            line = word;
+            width = word_width;
+        } else {
+            width += spaces + word_width;
+        }
+        line_end = i;
+    }
+    add_line(layout, line, line_end);
+    return layout;
+}
+
+static void render_message(int64_t row, MessageType type, StringView sender, StringView text) {
+    if (type == MESSAGE_JOIN)
+        text = (StringView){.data = "joined", .len = 6};
+    Clay_String username = {
+        .chars = sender.data,
+        .length = sender.len,
+    };
+    TextLayout *layout = text_layout(row, sender, text);
+    CLAY_AUTO_ID({.layout = {.layoutDirection = CLAY_LEFT_TO_RIGHT, .childGap = SENDER_GAP, .childAlignment.y = CLAY_ALIGN_Y_CENTER}}) {
+        CLAY_AUTO_ID({.layout.padding = CLAY_PADDING_ALL(SENDER_PADDING), .backgroundColor = CATPPUCCIN_SURFACE0, .cornerRadius = CLAY_CORNER_RADIUS(8)}) {
+            CLAY_TEXT(username, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_TEXT, .userData = GLES3_RETAINED_TEXT}));
+        }
+        Clay_Color color = type == MESSAGE_NORMAL ? CATPPUCCIN_TEXT : CATPPUCCIN_SUBTEXT0;
+        if (layout == NULL) {
+            Clay_String message = {.chars = text.data, .length = text.len};
+            CLAY_TEXT(message, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = color}));
+        } else {
+            CLAY_AUTO_ID({.layout.layoutDirection = CLAY_TOP_TO_BOTTOM}) {
+                for (size_t i = 0; i < layout->lines.len; i++) {
+                    // the text lives in buffers that are freed and reused, so
+                    // Clay has to hash the contents to tell lines apart
+                    Clay_String line = {
+                        .isStaticallyAllocated = false,
+                        .chars = text.data + layout->lines.data[i].offset,
+                        .length = layout->lines.data[i].len,
+                    };
+                    CLAY_TEXT(line, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = color, .wrapMode = CLAY_TEXT_WRAP_NONE,
+                                                      .userData = GLES3_RETAINED_TEXT}));
+                }
+            }
+        }
+    }
+}
+
+static float row_height(int64_t row) {
+    size_t slot = (uint64_t)row % ROW_HEIGHT_CACHE;
+    if (message_view.heights[slot].height > 0 && message_view.heights[slot].row == row)
+        return message_view.heights[slot].height;
+    return message_view.estimate;
+}
+
+// Reads back the heights of the rows laid out in the last frame
+static void measure_rows(void) {
+    for (size_t k = 0; k < message_view.laid_out_len; k++) {
+        Clay_ElementData row = Clay_GetElementData(CLAY_IDI("MessageRow", k));
+        if (!row.found || row.boundingBox.height <= 0)
+            continue;
+        int64_t n = message_view.laid_out[k];
+        size_t slot = (uint64_t)n % ROW_HEIGHT_CACHE;
+        message_view.heights[slot].row = n;
+        message_view.heights[slot].height = row.boundingBox.height;
+        if (row.boundingBox.height < message_view.estimate)
+            message_view.estimate = row.boundingBox.height;
+    }
+}
+
+static int64_t row_at(const MessageRows *rows, size_t i) {
+    for (size_t r = 0; r < ARRLEN(rows->ranges); r++) {
+        if (i < rows->ranges[r].len)
+            return rows->ranges[r].first + i;
+        i -= rows->ranges[r].len;
+    }
+    return 0;
+}
+
+// Index of `row`, or of the next one after it if it is not there
+static size_t row_index(const MessageRows *rows, int64_t row) {
+    size_t i = 0;
+    for (size_t r = 0; r < ARRLEN(rows->ranges); r++) {
+        const RowRange *range = &rows->ranges[r];
+        if (range->len == 0)
+            continue;
+        if (row < range->first)
+            return i;
+        if (row < range->first + (int64_t)range->len)
+            return i + (row - range->first);
+        i += range->len;
+    }
+    return rows->count > 0 ? rows->count - 1 : 0;
+}
+
+static void render_row(IrcConnection *conn, Channel *channel, const MessageRows *rows, int64_t row) {
+    Messages *messages = channel == NULL ? &conn->system_messages : &channel->messages;
+    const RowRange *backlog = &rows->ranges[0], *log = &rows->ranges[1];
+    const RowRange *memory = &rows->ranges[2], *unechoed = &rows->ranges[3];
+    if (backlog->len > 0 && row < 0) {
+        Message *msg = channel->backlog.data[-row - 1];
+        render_message(row, msg->type, interned(&conn->senders, msg->sender), (StringView){.data = msg->text, .len = msg->len});
+    } else if (log->len > 0 && row >= log->first && row < log->first + (int64_t)log->len) {
+        LogLine line;
+        if (log_line(irc_log(conn, channel), row, &line))
+            render_message(row, line.type, line.sender, line.text);
+    } else if (row >= memory->first && row < memory->first + (int64_t)memory->len) {
+        Message *msg = messages_get(messages, row - memory->first);
+        render_message(row, msg->type, interned(&conn->senders, msg->sender), (StringView){.data = msg->text, .len = msg->len});
+    } else if (unechoed->len > 0) {
+        // sent, but not echoed back by the server yet
+        StringBuilder *text = &channel->unechoed.data[row - unechoed->first];
+        render_message(row, MESSAGE_CLIENT, (StringView){.data = conn->nick.data, .len = conn->nick.len},
+                       (StringView){.data = text->data, .len = text->len});
+    }
+}
+
+void render_messages(float scroll_y) {
+    IrcConnection *conn = connections.data[current_connection];
+    Channel *channel = current_channel == -1 ? NULL : conn->channels.data[current_channel];
+    Messages *messages = channel == NULL ? &conn->system_messages : &channel->messages;
+    size_t *history = channel == NULL ? &conn->system_history : &channel->history;
+    Log *log = irc_log(conn, channel);
+    messages_viewed(messages);
+    if (channel != NULL)
+        channel->unread = channel->highlights = 0;
+    if (message_view.estimate == 0)
+        message_view.estimate = font_size + 10 + MESSAGE_ROW_GAP;
+    if (message_view.conn != conn || message_view.channel != channel)
+        reset_message_view(conn, channel);
+    Clay_ElementData box = Clay_GetElementData(CLAY_ID("Messages"));
+    if (box.found && box.boundingBox.width != message_view.width) {
+        message_view.width = box.boundingBox.width;
+        memset(message_view.heights, 0, sizeof(message_view.heights));
+        message_view.layout_generation++;
+    } else {
+        measure_rows();
+    }
+    // the lines that are already in memory or in the log are numbered by
+    // their line in the log
+    int64_t in_memory = log->session_start + messages->dropped;
+
+    // older lines are only read from the log when scrolled
+    // to the top, or when there is too little to fill a page
+    size_t available = log->session_start + messages->dropped;
+    if (available > log->flushed)
+        available = log->flushed;
+    int64_t top = channel != NULL && *history == available ? -(int64_t)channel->backlog.len
+                  : (int64_t)(available - *history);
+    bool at_top = scroll_y > 0 && message_view.anchor <= top && message_view.anchor_offset <= 0;
+    // once the log is used up, older lines are fetched from the server
+    if (channel != NULL && *history >= available &&
+        (at_top || *history + messages->len + channel->backlog.len < HISTORY_PAGE))
+        irc_request_history(conn, channel);
+    if (at_top)
+        *history += HISTORY_PAGE;
+    if (*history + messages->len < HISTORY_PAGE)
+        *history = HISTORY_PAGE - messages->len;
+    if (*history > available)
+        *history = available;
+    if (!log_map(log, available))
+        *history = 0;
+
+    MessageRows rows = {0};
+    if (channel != NULL && *history == available)
+        rows.ranges[0] = (RowRange){.first = -(int64_t)channel->backlog.len, .len = channel->backlog.len};
+    rows.ranges[1] = (RowRange){.first = available - *history, .len = *history};
+    rows.ranges[2] = (RowRange){.first = in_memory, .len = messages->len};
+    if (channel != NULL)
+        rows.ranges[3] = (RowRange){.first = in_memory + messages->len, .len = channel->unechoed.len};
+    for (size_t r = 0; r < ARRLEN(rows.ranges); r++)
+        rows.count += rows.ranges[r].len;
+
+    if (jump.scroll && jump.hit.conn == conn && jump.hit.channel == channel) {
+        if (jump.hit.line >= messages->dropped) {
+            message_view.anchor = log->session_start + jump.hit.line;
+            message_view.anchor_offset = 0;
+            message_view.follow = false;
+        }
+        jump.scroll = false;
+    }
+
+    // Clay moved the scroll position for the wheel and for dragging, that
+    // is turned into moving the anchor
+    Clay_ScrollContainerData scroll = Clay_GetScrollContainerData(CLAY_ID("Messages"));
+    float moved = scroll.found && message_view.placed ? -scroll.scrollPosition->y - message_view.position : 0;
+    if (moved < 0)
+        message_view.follow = false;
+    float viewport = box.found ? box.boundingBox.height - 32 : 0;
+    size_t anchor = row_index(&rows, message_view.anchor);
+    float offset = message_view.anchor_offset + moved;
+    while (offset < 0 && anchor > 0)
+        offset += row_height(row_at(&rows, --anchor));
+    while (rows.count > 0 && anchor + 1 < rows.count && offset >= row_height(row_at(&rows, anchor)))
+        offset -= row_height(row_at(&rows, anchor++));
+    if (offset < 0 || rows.count == 0)
+        offset = 0;
+    if (!message_view.follow && moved > 0) {
+        // scrolled down to the newest row
+        float filled = -offset;
+        size_t i = anchor;
+        while (i < rows.count && filled <= viewport)
+            filled += row_height(row_at(&rows, i++));
+        message_view.follow = i == rows.count && filled <= viewport + 1;
+    }
+    if (message_view.follow) {
+        float filled = 0;
+        anchor = rows.count;
+        while (anchor > 0 && filled < viewport)
+            filled += row_height(row_at(&rows, --anchor));
+        offset = filled > viewport ? filled - viewport : 0;
+    }
+
+    size_t first = anchor > MESSAGE_OVERSCAN ? anchor - MESSAGE_OVERSCAN : 0;
+    size_t end = anchor;
+    for (float filled = -offset; end < rows.count && filled < viewport; end++)
+        filled += row_height(row_at(&rows, end));
+    end = end + MESSAGE_OVERSCAN < rows.count ? end + MESSAGE_OVERSCAN : rows.count;
+    if (end - first > MESSAGE_MAX_ROWS)
+        end = first + MESSAGE_MAX_ROWS;
+    float above = (first < MESSAGE_SPACER_ROWS ? first : MESSAGE_SPACER_ROWS) * message_view.estimate;
+    float below = (rows.count - end < MESSAGE_SPACER_ROWS ? rows.count - end : MESSAGE_SPACER_ROWS) * message_view.estimate;
+    float position = above + offset;
+    for (size_t i = first; i < anchor; i++)
+        position += row_height(row_at(&rows, i));
+    if (scroll.found)
+        scroll.scrollPosition->y = -position;
+    message_view.anchor = rows.count > 0 ? row_at(&rows, anchor) : 0;
+    message_view.anchor_offset = offset;
+    message_view.position = position;
+    message_view.placed = scroll.found;
+
+    CLAY(CLAY_ID("Messages"), {.layout = {.childAlignment.y = CLAY_ALIGN_Y_BOTTOM,
+                                          .layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                          .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)},
+                                          .padding = CLAY_PADDING_ALL(MESSAGES_PADDING)},
+                               .clip = {.vertical = true, .childOffset = {0, -position}}}) {
+        if (above > 0)
+            CLAY_AUTO_ID({.layout.sizing.height = CLAY_SIZING_FIXED(above)}) {}
+        message_view.laid_out_len = 0;
+        for (size_t i = first; i < end; i++) {
+            int64_t row = row_at(&rows, i);
+            bool target = jump.hit.conn == conn && jump.hit.channel == channel &&
+                          row == log->session_start + (int64_t)jump.hit.line;
+            CLAY(CLAY_IDI("MessageRow", message_view.laid_out_len), {.layout.padding.bottom = MESSAGE_ROW_GAP}) {
+                if (target) {
+                    CLAY_AUTO_ID({.backgroundColor = CATPPUCCIN_SURFACE1, .cornerRadius = CLAY_CORNER_RADIUS(8)}) {
+                        render_row(conn, channel, &rows, row);
+                    }
+                } else {
+                    render_row(conn, channel, &rows, row);
+                }
+            }
+            message_view.laid_out[message_view.laid_out_len++] = row;
+        }
+        if (below > 0)
+            CLAY_AUTO_ID({.layout.sizing.height = CLAY_SIZING_FIXED(below)}) {}
+    }
+}
+
+static void join_from_directory(IrcConnection *conn, uint32_t entry) {
+    Channel *channel = channels_add(&conn->channels, directory_name(&conn->directory, entry));
+    if (channel->topic.len == 0) {
+        StringView topic = directory_topic(&conn->directory, entry);
+        da_append_many(channel->topic, topic.data, topic.len);
+    }
+    if (!channel->joined && !channel->join_pending)
+        channel->join_pending = irc_join_channel(conn, &channel->name);
+    for (size_t i = 0; i < conn->channels.len; i++) {
+        if (conn->channels.data[i] == channel)
+            current_channel = i;
+    }
+    show_directory = false;
+}
+
+void render_directory(RGFW_window *win) {
+    IrcConnection *conn = connections.data[current_connection];
+    ChannelDirectory *dir = &conn->directory;
+    uint32_t min_users = 0;
+    for (size_t i = 0; i < min_users_input.len && '0' <= min_users_input.data[i] && min_users_input.data[i] <= '9'; i++)
+        min_users = min_users * 10 + (min_users_input.data[i] - '0');
+    if (min_users != dir->min_users) {
+        dir->min_users = min_users;
+        dir->dirty = true;
+    }
+    directory_update_view(dir);
+
+    CLAY(CLAY_ID("Directory"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                           .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)},
+                                           .padding = CLAY_PADDING_ALL(16),
+                                           .childGap = 8}}) {
+        CLAY_AUTO_ID({.layout = {.sizing.width = CLAY_SIZING_GROW(0), .childGap = 8, .childAlignment.y = CLAY_ALIGN_Y_CENTER}}) {
+            struct {
+                Clay_String text;
+                DirectorySort sort;
+            } sorts[] = {
+                {CLAY_STRING(" Most users "), DIRECTORY_SORT_USERS},
+                {CLAY_STRING(" Name "),       DIRECTORY_SORT_NAME},
+            };
+            for (size_t i = 0; i < ARRLEN(sorts); i++) {
+                Clay_Color bg = dir->sort == sorts[i].sort ? CATPPUCCIN_PINK : CATPPUCCIN_SURFACE1;
+                Clay_Color fg = dir->sort == sorts[i].sort ? CATPPUCCIN_BASE : CATPPUCCIN_TEXT;
+                if (render_button(win, sorts[i].text, CLAY_SIZING_FIT(0), bg, color_alpha(bg, 128), fg) && dir->sort != sorts[i].sort) {
+                    dir->sort = sorts[i].sort;
+                    dir->dirty = true;
+                }
+            }
+            render_text_input(win, CLAY_SIZING_FIXED(200), &min_users_input, CLAY_ID("MinUsers"), CLAY_STRING("Min. users..."));
+            static char status[64];
+            int len = snprintf(status, sizeof(status), "%zu of %zu%s", dir->view.len, dir->names.len,
+                               dir->complete ? "" : ", loading...");
+            Clay_String status_text = {.chars = status, .length = len};
+            CLAY_TEXT(status_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_SUBTEXT0}));
+        }
+        CLAY(CLAY_ID("DirectoryList"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                                   .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)},
+                                                   .childGap = 3},
+                                        .clip = {.vertical = true, .childOffset = Clay_GetScrollOffset()}}) {
+            static char users[DIRECTORY_MAX_ROWS][12];
+            for (size_t row = 0; row < dir->view.len && row < DIRECTORY_MAX_ROWS; row++) {
+                uint32_t entry = dir->view.data[row];
+                StringView name = directory_name(dir, entry);
+                StringView topic = directory_topic(dir, entry);
+                int users_len = snprintf(users[row], sizeof(users[row]), "%u", dir->users.data[entry]);
+                Clay_String name_text = {.chars = name.data, .length = name.len};
+                Clay_String users_text = {.chars = users[row], .length = users_len};
+                Clay_String topic_text = {.chars = topic.data, .length = topic.len};
+                CLAY_AUTO_ID({.layout = {.sizing.width = CLAY_SIZING_GROW(0), .childGap = 8, .padding = CLAY_PADDING_ALL(5), .childAlignment.y = CLAY_ALIGN_Y_CENTER},
+                              .backgroundColor = Clay_Hovered() ? CATPPUCCIN_SURFACE1 : CATPPUCCIN_BASE,
+                              .cornerRadius = CLAY_CORNER_RADIUS(8)}) {
+                    if (Clay_Hovered()) {
+                        RGFW_window_setMouseStandard(win, RGFW_mousePointingHand);
+                        if (RGFW_window_isMouseDown(win, RGFW_mouseLeft))
+                            join_from_directory(conn, entry);
+                    }
+                    CLAY_TEXT(name_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_PINK}));
+                    CLAY_TEXT(users_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_SUBTEXT0}));
+                    CLAY_TEXT(topic_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_TEXT}));
+                }
+            }
+        }
+    }
+}
+
+void render_members(Channel *channel) {
+    IrcConnection *conn = connections.data[current_connection];
+    CLAY(CLAY_ID("Members"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                         .sizing = {CLAY_SIZING_FIXED(220), CLAY_SIZING_GROW(0)},
+                                         .padding = CLAY_PADDING_ALL(16),
+                                         .childGap = 8},
+                              .backgroundColor = CATPPUCCIN_SURFACE0}) {
+        static char count[32];
+        int count_len = snprintf(count, sizeof(count), "%zu users", channel->members.len);
+        Clay_String count_text = {.chars = count, .length = count_len};
+        CLAY_TEXT(count_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_SUBTEXT0}));
+        CLAY(CLAY_ID("MemberList"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                                .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)}},
+                                     .clip = {.vertical = true, .childOffset = Clay_GetScrollOffset()}}) {
+            // rows have a fixed height, so only the visible ones are laid out
+            // and the rest is replaced by two spacers
+            size_t first = 0, end = channel->members.len;
+            Clay_ScrollContainerData scroll = Clay_GetScrollContainerData(CLAY_ID("MemberList"));
+            if (scroll.found) {
+                float skipped = -scroll.scrollPosition->y / MEMBER_ROW_HEIGHT;
+                first = skipped > 0 ? (size_t)skipped : 0;
+                if (first > channel->members.len)
+                    first = channel->members.len;
+                size_t visible = scroll.scrollContainerDimensions.height / MEMBER_ROW_HEIGHT + 2;
+                if (end - first > visible)
+                    end = first + visible;
+            } else if (end > 64) {
+                end = 64;
+            }
+            CLAY_AUTO_ID({.layout.sizing.height = CLAY_SIZING_FIXED(first * MEMBER_ROW_HEIGHT)}) {}
+            for (size_t i = first; i < end; i++) {
+                Member *member = &channel->members.data[i];
+                StringView nick = interned(&conn->senders, member->nick);
+                Clay_String nick_text = {.chars = nick.data, .length = nick.len};
+                CLAY_AUTO_ID({.layout = {.sizing.height = CLAY_SIZING_FIXED(MEMBER_ROW_HEIGHT),
+                                         .childAlignment.y = CLAY_ALIGN_Y_CENTER}}) {
+                    if (member->prefix != 0) {
+                        Clay_String prefix = {.chars = &member->prefix, .length = 1};
+                        CLAY_TEXT(prefix, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_PINK}));
+                    }
+                    CLAY_TEXT(nick_text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_TEXT}));
+                }
+            }
+            CLAY_AUTO_ID({.layout.sizing.height = CLAY_SIZING_FIXED((channel->members.len - end) * MEMBER_ROW_HEIGHT)}) {}
+        }
+    }
+}
+
+// The channels of one connection in sidebar order. Rows have a fixed height,
+// so like the member list only the ones inside the visible part of SideBarList
+// are laid out, found from where the list was placed last frame.
+void render_sidebar_channels(RGFW_window *win, size_t c) {
+    IrcConnection *conn = connections.data[c];
+    Channels *channels = &conn->channels;
+    static char badges[SIDEBAR_MAX_ROWS][16];
+    size_t first = 0, end = channels->sidebar.len;
+    Clay_ElementData list = Clay_GetElementData(CLAY_IDI("SideBarChannels", c));
+    Clay_ElementData view = Clay_GetElementData(CLAY_ID("SideBarList"));
+    if (list.found && view.found) {
+        // how far the viewport starts below the top of this list
+        float top = view.boundingBox.y - list.boundingBox.y;
+        float bottom = top + view.boundingBox.height;
+        first = top > 0 ? (size_t)(top / SIDEBAR_ROW_HEIGHT) : 0;
+        size_t last = bottom > 0 ? (size_t)(bottom / SIDEBAR_ROW_HEIGHT) + 1 : 0;
+        if (first > channels->sidebar.len)
+            first = channels->sidebar.len;
+        if (end > last)
+            end = last > first ? last : first;
+    }
+    if (end - first > SIDEBAR_MAX_ROWS)
+        end = first + SIDEBAR_MAX_ROWS;
+    CLAY(CLAY_IDI("SideBarChannels", c), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                                     .sizing.width = CLAY_SIZING_GROW(0)}}) {
+        CLAY_AUTO_ID({.layout.sizing.height = CLAY_SIZING_FIXED(first * SIDEBAR_ROW_HEIGHT)}) {}
+        for (size_t i = first; i < end; i++) {
+            Channel *channel = channels->sidebar.data[i];
+            Clay_String name = {.chars = channel->name.data, .length = channel->name.len};
+            CLAY_AUTO_ID({.layout = {.sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_FIXED(SIDEBAR_ROW_HEIGHT)},
+                                     .padding.bottom = SIDEBAR_ROW_HEIGHT - 32}}) {
+                CLAY_AUTO_ID({.layout = {.sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_FIXED(32)},
+                                         .padding = {.left = 12, .right = 12},
+                                         .childAlignment.y = CLAY_ALIGN_Y_CENTER},
+                              .backgroundColor = Clay_Hovered() ? CATPPUCCIN_SURFACE2 : CATPPUCCIN_SURFACE1,
+                              .cornerRadius = CLAY_CORNER_RADIUS(font_size / 2.)}) {
+                    if (Clay_Hovered()) {
+                        RGFW_window_setMouseStandard(win, RGFW_mousePointingHand);
+                        if (RGFW_window_isMouseDown(win, RGFW_mouseLeft)) {
+                            current_connection = c;
+                            for (size_t j = 0; j < channels->len; j++) {
+                                if (channels->data[j] == channel)
+                                    current_channel = j;
+                            }
+                            show_directory = false;
+                            if (!channel->joined && !channel->join_pending)
+                                channel->join_pending = irc_join_channel(conn, &channel->name);
+                        }
+                    }
+                    CLAY_TEXT(name, CLAY_TEXT_CONFIG({.fontSize = font_size,
+                                                      .textColor = channel->joined ? CATPPUCCIN_TEXT : CATPPUCCIN_OVERLAY0}));
+                    if (channel->unread > 0) {
+                        CLAY_AUTO_ID({.layout.sizing.width = CLAY_SIZING_GROW(0)}) {}
+                        char *badge = badges[i - first];
+                        int len = snprintf(badge, sizeof(badges[0]), "%u", channel->unread);
+                        Clay_String count = {.chars = badge, .length = len};
+                        CLAY_AUTO_ID({.layout.padding = {.left = 6, .right = 6},
+                                      .backgroundColor = channel->highlights > 0 ? CATPPUCCIN_PINK : CATPPUCCIN_SURFACE2,
+                                      .cornerRadius = CLAY_CORNER_RADIUS(font_size / 2.)}) {
+                            CLAY_TEXT(count, CLAY_TEXT_CONFIG({.fontSize = font_size,
+                                                               .textColor = channel->highlights > 0 ? CATPPUCCIN_BASE : CATPPUCCIN_TEXT}));
+                        }
+                    }
+                }
+            }
+        }
+        CLAY_AUTO_ID({.layout.sizing.height = CLAY_SIZING_FIXED((channels->sidebar.len - end) * SIDEBAR_ROW_HEIGHT)}) {}
+    }
+}
+
+void render_chat(RGFW_window *win, float scroll_y) {
     CLAY(CLAY_ID("ChattingWindow"), {.layout = {.sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)}}, .backgroundColor = CATPPUCCIN_BASE}) {
         CLAY(CLAY_ID("SideBar"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
                                   .sizing = {.width = CLAY_SIZING_FIXED(300), .height = CLAY_SIZING_GROW(0)},
                                   .padding = CLAY_PADDING_ALL(16),
                                   .childGap = 16}, .backgroundColor = (Clay_Color)CATPPUCCIN_SURFACE0}) {
-            for (size_t i = 0; i < channels.len; i++) {
-                Clay_String str = {
-                    .chars = channels.data[i].name.data,
-                    .length = channels.data[i].name.len,
-                    .isStaticallyAllocated = false,
-                };
-                if (render_button(win, str, CLAY_SIZING_GROW(0), CATPPUCCIN_SURFACE1, CATPPUCCIN_SURFACE2, CATPPUCCIN_TEXT)) {
-                    current_channel = i;
-                    if (!channels.data[i].joined) {
-                        irc_join_channel(&channels.data[i].name);
-                        channels.data[i].joined = true;
+            CLAY(CLAY_ID("SideBarList"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                                     .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)},
+                                                     .childGap = 16},
+                                          .clip = {.vertical = true, .childOffset = Clay_GetScrollOffset()}}) {
+                for (size_t c = 0; c < connections.len; c++) {
+                    IrcConnection *conn = connections.data[c];
+                    Clay_String server_name = {
+                        .chars = conn->server.data,
+                        .length = conn->server.len,
+                        .isStaticallyAllocated = false,
+                    };
+                    if (render_button(win, server_name, CLAY_SIZING_GROW(0), CATPPUCCIN_SURFACE2, CATPPUCCIN_OVERLAY0, conn->connected ? CATPPUCCIN_TEXT : CATPPUCCIN_RED)) {
+                        current_connection = c;
+                        current_channel = -1;
+                        show_directory = false;
+                    }
+                    if (conn->status.len > 0) {
+                        Clay_String status = {.chars = conn->status.data, .length = conn->status.len};
+                        CLAY_TEXT(status, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_SUBTEXT0}));
+                    }
+                    if (conn->directory.names.len > 0 &&
+                        render_button(win, CLAY_STRING("Browse channels"), CLAY_SIZING_GROW(0), CATPPUCCIN_SURFACE1, CATPPUCCIN_SURFACE2, CATPPUCCIN_SUBTEXT0)) {
+                        current_connection = c;
+                        current_channel = -1;
+                        show_directory = true;
                     }
+                    render_sidebar_channels(win, c);
                 }
             }
+            if (render_button(win, CLAY_STRING("+"), CLAY_SIZING_GROW(0), CATPPUCCIN_PINK, color_alpha(CATPPUCCIN_PINK, 128), CATPPUCCIN_BASE)) {
+                state = STATE_LOGIN;
+            }
         }
         CLAY(CLAY_ID("InputAndMessages"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
                                                       .childAlignment.y = CLAY_ALIGN_Y_BOTTOM,
                                                       .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)}}}) {
+            render_search(win);
             CLAY(CLAY_ID("Chat")) {
-                CLAY_AUTO_ID({.layout = {.childAlignment.y = CLAY_ALIGN_Y_BOTTOM,
-                                         .childGap = 3,
-                                         .layoutDirection = CLAY_TOP_TO_BOTTOM,
-                                         .sizing = {CLAY_SIZING_GROW(0), CLAY_SIZING_GROW(0)},
-                                         .padding = CLAY_PADDING_ALL(16)},
-                              .clip = {.vertical = true, .childOffset = Clay_GetScrollOffset()}}) {
-                    Messages *messages = current_channel == -1
-                                             ? &system_messages
-                                             : &channels.data[current_channel].messages;
-                    for (size_t i = 0; i < messages->len; i++) {
-                        Clay_String text = {
-                            .chars = messages->data[i].text.data,
-                            .length = messages->data[i].text.len,
-                        };
-                        Clay_String username = {
-                            .chars = messages->data[i].sender.data,
-                            .length = messages->data[i].sender.len,
-                        };
-                        CLAY_AUTO_ID({.layout = {.layoutDirection = CLAY_LEFT_TO_RIGHT, .childGap = 8, .childAlignment.y = CLAY_ALIGN_Y_CENTER}}) {
-                            CLAY_AUTO_ID({.layout.padding = CLAY_PADDING_ALL(5), .backgroundColor = CATPPUCCIN_SURFACE0, .cornerRadius = CLAY_CORNER_RADIUS(8)}) {
-                                CLAY_TEXT(username, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_TEXT}));
-                            }
-                            CLAY_TEXT(text, CLAY_TEXT_CONFIG({.fontSize = font_size, .textColor = CATPPUCCIN_TEXT}));
-                        }
-                    }
-                }
+                if (show_directory)
+                    render_directory(win);
+                else
+                    render_messages(scroll_y);
             }
             CLAY_AUTO_ID({.layout.sizing.width = CLAY_SIZING_GROW(0)}) {
                 render_text_input(win, CLAY_SIZING_GROW(0), &the_message,
                                   CLAY_ID("Textbox"),
                                   CLAY_STRING("Your message here..."));
                 bool send_button = render_button( win, CLAY_STRING(" Send "), CLAY_SIZING_FIT(0), CATPPUCCIN_PINK, color_alpha(CATPPUCCIN_PINK, 128), CATPPUCCIN_BASE);
-                if (send_button && the_message.len > 0 && current_channel != -1) {
-                    Message msg = {0};
-                    msg.sender.data = username.data;
-                    msg.sender.len  = username.len;
-                    da_append_many(msg.text, the_message.data, the_message.len);
-                    da_append(channels.data[current_channel].messages, msg);
-                    irc_send_message(&the_message, &channels.data[current_channel].name);
+                IrcConnection *conn = connections.data[current_connection];
+                // the text stays in the box until the connection is back
+                if (send_button && the_message.len > 0 && current_channel != -1 && conn->connected &&
+                    irc_send_message(conn, &the_message, &conn->channels.data[current_channel]->name)) {
+                    Channel *channel = conn->channels.data[current_channel];
+                    if (conn->caps & CAP_ECHO_MESSAGE) {
+                        // the server sends it back like any other message
+                        StringBuilder pending = {0};
+                        da_append_many(pending, the_message.data, the_message.len);
+                        da_append(channel->unechoed, pending);
+                    } else {
+                        StringView nick = {.data = conn->nick.data, .len = conn->nick.len};
+                        StringView text = {.data = the_message.data, .len = the_message.len};
+                        Message *msg = message_new(MESSAGE_NORMAL, intern(&conn->senders, nick), text);
+                        irc_add_message(conn, channel, msg);
+                    }
                     the_message.len = 0;
                 }
             }
         }
+        if (current_channel != -1 && !show_directory)
+            render_members(connections.data[current_connection]->channels.data[current_channel]);
+    }
+}
+
+// Whether a scroll container moved since the end of the last frame, which
+// means momentum is still carrying it. With `record` the current positions
+// are stored instead.
+bool scroll_moved(bool record) {
+    Clay_ElementId ids[] = {CLAY_ID("SearchResults"), CLAY_ID("Messages"), CLAY_ID("DirectoryList"),
+                            CLAY_ID("MemberList"), CLAY_ID("SideBarList")};
+    static_assert(ARRLEN(ids) == ARRLEN(scroll_positions));
+    bool moved = false;
+    for (size_t i = 0; i < ARRLEN(ids); i++) {
+        Clay_ScrollContainerData scroll = Clay_GetScrollContainerData(ids[i]);
+        float y = scroll.found ? scroll.scrollPosition->y : 0;
+        moved |= y != scroll_positions[i];
+        if (record)
+            scroll_positions[i] = y;
+    }
+    return moved;
+}
+
+void render_hud(void) {
+    IrcConnection *conn = current_connection != -1 ? connections.data[current_connection] : NULL;
+    StatsSummary s;
+    stats_summary(&s);
+    static char lines[7][96];
+    int lens[ARRLEN(lines)];
+    lens[0] = snprintf(lines[0], sizeof(lines[0]), "frame p50 %.1f  p90 %.1f  p99 %.1f  max %.1f ms",
+                       s.frame_p50, s.frame_p90, s.frame_p99, s.frame_max);
+    lens[1] = snprintf(lines[1], sizeof(lines[1]), "layout %.2f  render %.2f  network %.2f ms",
+                       s.layout_ms, s.render_ms, s.process_ms);
+    lens[2] = snprintf(lines[2], sizeof(lines[2]), "%.0f quads  %.0f glyphs  %.0f draw calls",
+                       s.quads, s.glyphs, s.draw_calls);
+    lens[3] = snprintf(lines[3], sizeof(lines[3]), "%.0f glyphs uploaded", s.uploaded_glyphs);
+    lens[4] = snprintf(lines[4], sizeof(lines[4]), "%.0f lines/s parsed", s.lines_per_second);
+    if (conn == NULL || conn->lag_ms < 0)
+        lens[5] = snprintf(lines[5], sizeof(lines[5]), "lag -");
+    else
+        lens[5] = snprintf(lines[5], sizeof(lines[5]), "lag %lld ms", (long long)conn->lag_ms);
+    lens[6] = snprintf(lines[6], sizeof(lines[6]), "over the last %zu frames", s.frames);
+    CLAY(CLAY_ID("Hud"), {.layout = {.layoutDirection = CLAY_TOP_TO_BOTTOM,
+                                     .padding = CLAY_PADDING_ALL(8),
+                                     .childGap = 2},
+                          .backgroundColor = color_alpha(CATPPUCCIN_CRUST, 220),
+                          .cornerRadius = CLAY_CORNER_RADIUS(8),
+                          .floating = {.attachTo = CLAY_ATTACH_TO_ROOT,
+                                       .attachPoints = {.element = CLAY_ATTACH_POINT_RIGHT_TOP,
+                                                        .parent = CLAY_ATTACH_POINT_RIGHT_TOP},
+                                       .offset = {-16, 16},
+                                       .zIndex = 100,
+                                       .pointerCaptureMode = CLAY_POINTER_CAPTURE_MODE_PASSTHROUGH}}) {
+        for (size_t i = 0; i < ARRLEN(lines); i++) {
+            Clay_String text = {.chars = lines[i], .length = lens[i]};
+            CLAY_TEXT(text, CLAY_TEXT_CONFIG({.fontSize = font_size * 3 / 4, .textColor = CATPPUCCIN_GREEN}));
+        }
     }
 }
 
@@ -209,9 +991,61 @@ void charfunc(const RGFW_event *e) {
     uint32_t codepoint = e->keyChar.value;
     if (current_input == NULL)
         return;
-    if (codepoint < 32 || codepoint > 126)
+    // shortcuts like zooming
+    if (RGFW_isKeyDown(RGFW_keyControlL) || RGFW_isKeyDown(RGFW_keyControlR))
+        return;
+    // control characters, surrogates and what is not Unicode
+    if (codepoint < 32 || codepoint == 127 || (codepoint >= 0xD800 && codepoint <= 0xDFFF) || codepoint > 0x10FFFF)
         return;
-    da_append(*current_input, (char)codepoint);
+    char utf8[4];
+    size_t len;
+    if (codepoint < 0x80) {
+        utf8[0] = codepoint;
+        len = 1;
+    } else if (codepoint < 0x800) {
+        utf8[0] = 0xC0 | codepoint >> 6;
+        utf8[1] = 0x80 | (codepoint & 0x3F);
+        len = 2;
+    } else if (codepoint < 0x10000) {
+        utf8[0] = 0xE0 | codepoint >> 12;
+        utf8[1] = 0x80 | (codepoint >> 6 & 0x3F);
+        utf8[2] = 0x80 | (codepoint & 0x3F);
+        len = 3;
+    } else {
+        utf8[0] = 0xF0 | codepoint >> 18;
+        utf8[1] = 0x80 | (codepoint >> 12 & 0x3F);
+        utf8[2] = 0x80 | (codepoint >> 6 & 0x3F);
+        utf8[3] = 0x80 | (codepoint & 0x3F);
+        len = 4;
+    }
+    da_append_many(*current_input, utf8, len);
+}
+
+// For what Roboto has no glyphs for, after the ones in TOKI_FONTS, which is a
+// list of font files separated by colons
+static const char *fallback_fonts[] = {
+    "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+    "/usr/share/fonts/TTF/DejaVuSans.ttf",
+    "/usr/share/fonts/opentype/noto/NotoSansCJK-Regular.ttc",
+    "/usr/share/fonts/noto-cjk/NotoSansCJK-Regular.ttc",
+    "/usr/share/fonts/google-noto-sans-cjk-fonts/NotoSansCJK-Regular.ttc",
+    "/usr/share/fonts/truetype/noto/NotoEmoji-Regular.ttf",
+    "/System/Library/Fonts/Supplemental/Arial Unicode.ttf",
+};
+
+static void load_fallback_fonts(Stb_FontData *font) {
+    const char *env = getenv("TOKI_FONTS");
+    while (env != NULL && *env != '\0') {
+        const char *end = strchr(env, ':');
+        int len = end != NULL ? end - env : (int)strlen(env);
+        char path[4096];
+        snprintf(path, sizeof(path), "%.*s", len, env);
+        if (len > 0 && !Stb_AddFallbackFont(font, path))
+            fprintf(stderr, "Could not load font %s\n", path);
+        env += end != NULL ? len + 1 : len;
+    }
+    for (size_t i = 0; i < ARRLEN(fallback_fonts) && font->faceCount < STB_MAX_FACES; i++)
+        Stb_AddFallbackFont(font, fallback_fonts[i]);
 }
 
 RGFW_window *init_rgfw(i32 w, i32 h) {
@@ -250,10 +1084,19 @@ int main() {
     Stb_FontData stbFonts[MAX_FONTS] = {0};
     Clay_SetCurrentContext(clay_ctx);
     Clay_SetMeasureTextFunction(Stb_MeasureText, &stbFonts);
+    fonts = stbFonts;
     Gles3_SetRenderTextFunction(&gles3, Stb_RenderText, &stbFonts);
     Gles3_Initialize(&gles3, 4096);
-    if (!Stb_LoadFontMemory(&gles3.fontTextures[0], &stbFonts[0], font, sizeof(font), 24.0f, 1024, 1024))
+    const char *sdf = getenv("TOKI_SDF");
+    bool use_sdf = sdf == NULL || strcmp(sdf, "0") != 0;
+    if (!Stb_LoadFontMemory(&gles3.fontTextures[0], &stbFonts[0], font, sizeof(font),
+                            use_sdf ? SDF_BAKE_SIZE : font_size, 1024, 1024))
         abort();
+    if (use_sdf) {
+        Stb_SetSdf(&stbFonts[0], true);
+        gles3.sdfFonts |= 1 << 0;
+    }
+    load_fallback_fonts(&stbFonts[0]);
     // Clay_SetDebugModeEnabled(true);
 
     RGFW_window_getSize(win, &w, &h);
@@ -261,49 +1104,101 @@ int main() {
     RGFW_window_getSizeInPixels(win, &pw, &ph);
     glViewport(0, 0, pw, ph);
 
+    // plain text servers like toki-mockd
+    const char *tls = getenv("TOKI_TLS");
+    if (tls != NULL && strcmp(tls, "0") == 0)
+        irc_set_tls(false, false, NULL);
+
     // // XXX
     // da_append_str(username, "kala_test");
     // da_append_str(server, "127.0.0.1");
     // state = STATE_CHAT;
     // irc_connect(&server, &username);
+    irc_set_wakeup(RGFW_stopCheckEvents);
+    double last_frame = stats_now_ms();
     while (!RGFW_window_shouldClose(win)) {
+        if (redraw == 0 && !show_hud)
+            RGFW_waitForEvent(IDLE_WAIT_MS);
+        double frame_start = stats_now_ms();
+        FrameStats frame = {0};
         RGFW_event event = { 0 };
         i32 x = 0, y = 0;
         while (RGFW_window_checkEvent(win, &event)) {
+            redraw = REDRAW_FRAMES;
             switch (event.type) {
             case RGFW_windowResized:
                 RGFW_window_getSize(win, &w, &h);
                 RGFW_window_getSizeInPixels(win, &pw, &ph);
                 glViewport(0, 0, pw, ph);
                 break;
+            case RGFW_keyPressed:
+                if (event.key.value == RGFW_keyF3 && !event.key.repeat)
+                    show_hud = !show_hud;
+                if (event.key.mod & RGFW_modControl) {
+                    if (event.key.value == RGFW_keyEquals)
+                        zoom = zoom + ZOOM_STEP < MAX_ZOOM ? zoom + ZOOM_STEP : MAX_ZOOM;
+                    else if (event.key.value == RGFW_keyMinus)
+                        zoom = zoom - ZOOM_STEP > MIN_ZOOM ? zoom - ZOOM_STEP : MIN_ZOOM;
+                    else if (event.key.value == RGFW_key0)
+                        zoom = 1;
+                }
+                break;
             }
         }
+        double process_start = stats_now_ms();
+        if (irc_proccess())
+            redraw = REDRAW_FRAMES;
+        frame.process_ms = stats_now_ms() - process_start;
+        if (redraw == 0 && !show_hud)
+            continue;
+        float dt = (frame_start - last_frame) / 1000;
+        last_frame = frame_start;
         float scroll_x = 0, scroll_y = 0;
         bool mouse_pressed = RGFW_isMouseDown(RGFW_mouseLeft);
-        Clay_SetLayoutDimensions((Clay_Dimensions){w, h});
+        Clay_SetLayoutDimensions((Clay_Dimensions){w / zoom, h / zoom});
         RGFW_window_getMouse(win, &x, &y);
         RGFW_getMouseScroll(&scroll_x, &scroll_y);
-        // TODO unhardcode fps
-        Clay_UpdateScrollContainers(true, (Clay_Vector2) {scroll_x, scroll_y}, 1./60.);
-        Clay_SetPointerState((Clay_Vector2){x, y}, mouse_pressed);
+        Clay_UpdateScrollContainers(true, (Clay_Vector2) {scroll_x, scroll_y}, dt < MAX_FRAME_DELTA ? dt : MAX_FRAME_DELTA);
+        Clay_SetPointerState((Clay_Vector2){x / zoom, y / zoom}, mouse_pressed);
+        if (redraw > 0)
+            redraw--;
+        if (scroll_moved(false) && redraw == 0)
+            redraw = 1;
+        double layout_start = stats_now_ms();
         Clay_BeginLayout();
         switch (state) {
         case STATE_LOGIN:
             render_login(win);
             break;
         case STATE_CHAT:
-            render_chat(win);
+            render_chat(win, scroll_y);
             break;
         }
+        if (show_hud)
+            render_hud();
 
         Clay_RenderCommandArray renderCommands = Clay_EndLayout();
+        scroll_moved(true);
+        double render_start = stats_now_ms();
+        frame.layout_ms = render_start - layout_start;
         glDisable(GL_DEPTH_TEST);
         glDepthMask(GL_FALSE);
         Gles3_Render(&gles3, renderCommands, stbFonts);
-        RGFW_window_swapBuffers_OpenGL(win);
-        if (server_fd > 0) {
-            irc_proccess();
+        frame.render_ms = stats_now_ms() - render_start;
+        frame.quads = gles3.quadsLastFrame;
+        frame.glyphs = gles3.glyphsLastFrame;
+        frame.draw_calls = gles3.drawCallsLastFrame;
+        frame.uploaded_glyphs = gles3.glyphsUploadedLastFrame;
+        // glyphs that did not fit into the atlas get drawn once it made room
+        Gles3_AtlasPages evicted[MAX_FONTS];
+        if (Stb_EndFrame(stbFonts, MAX_FONTS, gles3.pagesDrawn, evicted)) {
+            Gles3_ForgetRetainedText(&gles3, evicted);
+            redraw = REDRAW_FRAMES;
         }
+        RGFW_window_swapBuffers_OpenGL(win);
+        latency_rendered();
+        frame.frame_ms = stats_now_ms() - frame_start;
+        stats_frame(&frame);
     }
     RGFW_window_close(win);
     irc_close();
@@ -311,6 +1206,7 @@ int main() {
     free(gles3.clayMemory.memory);
     free(gles3.quadInstanceArray.instData);
     free(gles3.glyphVtxArray.instData);
-    free(stbFonts[0].cdata);
+    Stb_FreeFont(&stbFonts[0]);
     irc_destroy();
+    latency_report();
 }
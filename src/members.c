@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Members of a channel are kept sorted by their casefolded nick, so lookups
+// are binary searches. IrcConnection.memberships maps every nick id back to
+// the channels it is in, so a QUIT or NICK only touches those channels.
+
+// channel status prefixes of NAMES, highest first
+static const char member_prefixes[] = "~&@%+";
+
+// qsort has no context argument, the UI thread is the only one sorting
+static const IrcConnection *sorting;
+
+static int compare_nicks(const IrcConnection *conn, uint32_t a, uint32_t b) {
+    if (a == b)
+        return 0;
+    StringView na = interned(&conn->senders, a), nb = interned(&conn->senders, b);
+    for (size_t i = 0; i < na.len && i < nb.len; i++) {
+        unsigned char ca = casefold(conn->channels.casemapping, na.data[i]);
+        unsigned char cb = casefold(conn->channels.casemapping, nb.data[i]);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+    if (na.len != nb.len)
+        return na.len < nb.len ? -1 : 1;
+    // differ only in case, still has to be a total order
+    return a < b ? -1 : 1;
+}
+
+static int compare_members(const void *a, const void *b) {
+    return compare_nicks(sorting, ((const Member *)a)->nick, ((const Member *)b)->nick);
+}
+
+// Index of nick in members, or where it would have to be inserted
+static size_t find_member(const IrcConnection *conn, const Members *members, uint32_t nick, bool *found) {
+    size_t lo = 0, hi = members->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = compare_nicks(conn, members->data[mid].nick, nick);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = false;
+    return lo;
+}
+
+static ChannelRefs *memberships_of(IrcConnection *conn, uint32_t nick) {
+    while (conn->memberships.len <= nick)
+        da_append(conn->memberships, (ChannelRefs){0});
+    return &conn->memberships.data[nick];
+}
+
+static void unlink_channel(IrcConnection *conn, uint32_t nick, const Channel *channel) {
+    if (nick >= conn->memberships.len)
+        return;
+    ChannelRefs *refs = &conn->memberships.data[nick];
+    for (size_t i = 0; i < refs->len; i++) {
+        if (refs->data[i] == channel) {
+            refs->data[i] = da_last(*refs);
+            refs->len--;
+            return;
+        }
+    }
+}
+
+void members_join(IrcConnection *conn, Channel *channel, uint32_t nick, char prefix) {
+    bool found;
+    size_t at = find_member(conn, &channel->members, nick, &found);
+    if (found)
+        return;
+    da_reserve(channel->members, 1);
+    memmove(channel->members.data + at + 1, channel->members.data + at,
+            (channel->members.len - at) * sizeof(Member));
+    channel->members.data[at] = (Member){.nick = nick, .prefix = prefix};
+    channel->members.len++;
+    da_append(*memberships_of(conn, nick), channel);
+}
+
+static bool remove_member(IrcConnection *conn, Channel *channel, uint32_t nick, Member *removed) {
+    bool found;
+    size_t at = find_member(conn, &channel->members, nick, &found);
+    if (!found)
+        return false;
+    *removed = channel->members.data[at];
+    memmove(channel->members.data + at, channel->members.data + at + 1,
+            (channel->members.len - at - 1) * sizeof(Member));
+    channel->members.len--;
+    return true;
+}
+
+void members_part(IrcConnection *conn, Channel *channel, uint32_t nick) {
+    Member removed;
+    if (remove_member(conn, channel, nick, &removed))
+        unlink_channel(conn, nick, channel);
+}
+
+void members_quit(IrcConnection *conn, uint32_t nick) {
+    if (nick >= conn->memberships.len)
+        return;
+    ChannelRefs *refs = &conn->memberships.data[nick];
+    Member removed;
+    for (size_t i = 0; i < refs->len; i++)
+        remove_member(conn, refs->data[i], nick, &removed);
+    refs->len = 0;
+}
+
+void members_rename(IrcConnection *conn, uint32_t from, uint32_t to) {
+    if (from >= conn->memberships.len || from == to)
+        return;
+    // the list may move when memberships grows for `to`
+    ChannelRefs refs = conn->memberships.data[from];
+    conn->memberships.data[from] = (ChannelRefs){0};
+    for (size_t i = 0; i < refs.len; i++) {
+        Member removed;
+        if (remove_member(conn, refs.data[i], from, &removed))
+            members_join(conn, refs.data[i], to, removed.prefix);
+    }
+    free(refs.data);
+}
+
+void members_names(IrcConnection *conn, Channel *channel, StringView names) {
+    size_t i = 0;
+    while (i < names.len) {
+        while (i < names.len && names.data[i] == ' ')
+            i++;
+        char prefix = 0;
+        // multi-prefix gives all of them, the first one is the highest
+        while (i < names.len && memchr(member_prefixes, names.data[i], sizeof(member_prefixes) - 1) != NULL) {
+            if (prefix == 0)
+                prefix = names.data[i];
+            i++;
+        }
+        size_t start = i;
+        while (i < names.len && names.data[i] != ' ')
+            i++;
+        if (i == start)
+            continue;
+        uint32_t nick = intern(&conn->senders, (StringView){.data = names.data + start, .len = i - start});
+        da_append(channel->names_pending, ((Member){.nick = nick, .prefix = prefix}));
+    }
+}
+
+void members_end_of_names(IrcConnection *conn, Channel *channel) {
+    for (size_t i = 0; i < channel->members.len; i++)
+        unlink_channel(conn, channel->members.data[i].nick, channel);
+    Members members = channel->names_pending;
+    sorting = conn;
+    qsort(members.data, members.len, sizeof(*members.data), compare_members);
+    sorting = NULL;
+    // a nick can show up in several replies
+    size_t len = 0;
+    for (size_t i = 0; i < members.len; i++) {
+        if (len > 0 && members.data[len - 1].nick == members.data[i].nick)
+            continue;
+        members.data[len++] = members.data[i];
+        da_append(*memberships_of(conn, members.data[i].nick), channel);
+    }
+    members.len = len;
+    channel->names_pending = channel->members;
+    channel->names_pending.len = 0;
+    channel->members = members;
+}
+
+void members_sort(IrcConnection *conn) {
+    sorting = conn;
+    for (size_t i = 0; i < conn->channels.len; i++) {
+        Members *members = &conn->channels.data[i]->members;
+        qsort(members->data, members->len, sizeof(*members->data), compare_members);
+    }
+    sorting = NULL;
+}
+
+void members_clear(IrcConnection *conn, Channel *channel) {
+    for (size_t i = 0; i < channel->members.len; i++)
+        unlink_channel(conn, channel->members.data[i].nick, channel);
+    channel->members.len = 0;
+    channel->names_pending.len = 0;
+}
+
+void memberships_free(IrcConnection *conn) {
+    for (size_t i = 0; i < conn->memberships.len; i++)
+        free(conn->memberships.data[i].data);
+    free(conn->memberships.data);
+    conn->memberships.data = NULL;
+    conn->memberships.len = conn->memberships.cap = 0;
+}
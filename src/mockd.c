@@ -0,0 +1,440 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Mock IRC server and load generator, see `make mockd`. It speaks just the
+// part of the protocol irc.c handles and floods every registered client with
+// channel messages at a fixed rate:
+//
+//     toki-mockd [-p port] [-c channels] [-u users] [-r messages/s] [-d seconds]
+//
+// Channels are #chan0 and up, user i is in channel i % channels. The client
+// is joined to all of them. Every message text starts with "mockd:<send time>"
+// in microseconds of CLOCK_REALTIME, toki built with TOKI_LATENCY=1 turns
+// those into latency percentiles, see latency.c.
+
+#define ARRLEN(xs) (sizeof(xs) / sizeof(*(xs)))
+#define SERVER_NAME "mock.example"
+// no more messages are generated for a client while this much is unsent
+#define MAX_QUEUED (4 << 20)
+
+static struct {
+    int port;
+    uint32_t channels;
+    uint32_t users;
+    double rate;
+    double seconds;
+} config = {
+    .port = 6667,
+    .channels = 200,
+    .users = 2000,
+    .rate = 5000,
+    .seconds = 0,
+};
+
+typedef struct {
+    int fd;
+    StringBuilder in;
+    StringBuilder out;
+    // bytes of out already written
+    size_t written;
+    StringBuilder nick;
+    bool got_user;
+    // between CAP LS and CAP END
+    bool negotiating;
+    bool registered;
+    // one per channel
+    bool *joined;
+    int64_t registered_at;
+    uint64_t sent;
+    // messages the client was too slow for
+    uint64_t held_back;
+    // sent as of the last report
+    uint64_t reported;
+} Client;
+
+static struct {
+    Client **data;
+    size_t len, cap;
+} clients = {0};
+
+static uint64_t random_state = 0x2545F4914F6CDD1D;
+
+static uint32_t random_below(uint32_t n) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state % n;
+}
+
+static const char *words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+    "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+    "et", "dolore", "magna", "aliqua", "https://example.org/a/long/link",
+};
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sb_printf(StringBuilder *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void sb_printf(StringBuilder *sb, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    da_reserve(*sb, (size_t)n + 1);
+    va_start(args, fmt);
+    vsnprintf(sb->data + sb->len, n + 1, fmt, args);
+    va_end(args);
+    sb->len += n;
+}
+
+static const char *nick_of(Client *c) {
+    return c->nick.len > 0 ? c->nick.data : "*";
+}
+
+static void send_join(Client *c, uint32_t channel) {
+    if (c->joined[channel])
+        return;
+    c->joined[channel] = true;
+    sb_printf(&c->out, ":%s!mock@" SERVER_NAME " JOIN #chan%u\r\n", nick_of(c), channel);
+    sb_printf(&c->out, ":" SERVER_NAME " 332 %s #chan%u :Topic of mock channel %u\r\n", nick_of(c), channel, channel);
+    // RPL_NAMREPLY lines of up to 40 nicks
+    uint32_t in_line = 0;
+    for (uint32_t user = channel; user < config.users; user += config.channels) {
+        if (in_line == 0)
+            sb_printf(&c->out, ":" SERVER_NAME " 353 %s = #chan%u :%s", nick_of(c), channel, nick_of(c));
+        sb_printf(&c->out, " %suser%u", user % 50 == 0 ? "@" : "", user);
+        if (++in_line == 40) {
+            sb_printf(&c->out, "\r\n");
+            in_line = 0;
+        }
+    }
+    if (in_line > 0)
+        sb_printf(&c->out, "\r\n");
+    else if (channel >= config.users)
+        sb_printf(&c->out, ":" SERVER_NAME " 353 %s = #chan%u :%s\r\n", nick_of(c), channel, nick_of(c));
+    sb_printf(&c->out, ":" SERVER_NAME " 366 %s #chan%u :End of /NAMES list.\r\n", nick_of(c), channel);
+}
+
+static void try_register(Client *c) {
+    if (c->registered || c->nick.len == 0 || !c->got_user || c->negotiating)
+        return;
+    c->registered = true;
+    c->registered_at = now_us();
+    const char *nick = nick_of(c);
+    sb_printf(&c->out, ":" SERVER_NAME " 001 %s :Welcome to the mock network %s\r\n", nick, nick);
+    sb_printf(&c->out, ":" SERVER_NAME " 005 %s CASEMAPPING=ascii CHANTYPES=# PREFIX=(ov)@+ TARGMAX=JOIN:,PRIVMSG:1 :are supported by this server\r\n", nick);
+    sb_printf(&c->out, ":" SERVER_NAME " 376 %s :End of /MOTD command.\r\n", nick);
+    for (uint32_t i = 0; i < config.channels; i++)
+        send_join(c, i);
+    fprintf(stderr, "client %d registered as %s\n", c->fd, nick);
+}
+
+// "#chan<n>", or -1
+static int64_t parse_channel(StringView name) {
+    if (name.len <= 5 || memcmp(name.data, "#chan", 5) != 0)
+        return -1;
+    int64_t n = 0;
+    for (size_t i = 5; i < name.len; i++) {
+        if (name.data[i] < '0' || name.data[i] > '9' || n > config.channels)
+            return -1;
+        n = n * 10 + name.data[i] - '0';
+    }
+    return n < config.channels ? n : -1;
+}
+
+static StringView next_word(StringView *sv) {
+    while (sv->len > 0 && sv->data[0] == ' ') {
+        sv->data++;
+        sv->len--;
+    }
+    StringView word = {.data = sv->data, .len = 0};
+    if (sv->len > 0 && sv->data[0] == ':') {
+        word = (StringView){.data = sv->data + 1, .len = sv->len - 1};
+        sv->data += sv->len;
+        sv->len = 0;
+        return word;
+    }
+    while (word.len < sv->len && sv->data[word.len] != ' ')
+        word.len++;
+    sv->data += word.len;
+    sv->len -= word.len;
+    return word;
+}
+
+static bool word_is(StringView word, const char *s) {
+    return word.len == strlen(s) && memcmp(word.data, s, word.len) == 0;
+}
+
+// false when the client quit
+static bool handle_line(Client *c, StringView line) {
+    StringView command = next_word(&line);
+    if (word_is(command, "QUIT")) {
+        return false;
+    } else if (word_is(command, "CAP")) {
+        StringView sub = next_word(&line);
+        if (word_is(sub, "LS")) {
+            c->negotiating = true;
+            sb_printf(&c->out, ":" SERVER_NAME " CAP %s LS :\r\n", nick_of(c));
+        } else if (word_is(sub, "REQ")) {
+            StringView caps = next_word(&line);
+            sb_printf(&c->out, ":" SERVER_NAME " CAP %s NAK :%.*s\r\n", nick_of(c), (int)caps.len, caps.data);
+        } else if (word_is(sub, "END")) {
+            c->negotiating = false;
+            try_register(c);
+        }
+    } else if (word_is(command, "NICK")) {
+        StringView nick = next_word(&line);
+        c->nick.len = 0;
+        da_append_many(c->nick, nick.data, nick.len);
+        da_append(c->nick, '\0');
+        c->nick.len--;
+        try_register(c);
+    } else if (word_is(command, "USER")) {
+        c->got_user = true;
+        try_register(c);
+    } else if (word_is(command, "PING")) {
+        StringView token = next_word(&line);
+        sb_printf(&c->out, ":" SERVER_NAME " PONG " SERVER_NAME " :%.*s\r\n", (int)token.len, token.data);
+    } else if (!c->registered) {
+        sb_printf(&c->out, ":" SERVER_NAME " 451 %s :You have not registered\r\n", nick_of(c));
+    } else if (word_is(command, "JOIN")) {
+        StringView targets = next_word(&line);
+        while (targets.len > 0) {
+            StringView target = {.data = targets.data, .len = 0};
+            while (target.len < targets.len && targets.data[target.len] != ',')
+                target.len++;
+            int64_t channel = parse_channel(target);
+            if (channel >= 0)
+                send_join(c, channel);
+            else
+                sb_printf(&c->out, ":" SERVER_NAME " 403 %s %.*s :No such channel\r\n", nick_of(c), (int)target.len, target.data);
+            size_t skip = target.len < targets.len ? target.len + 1 : target.len;
+            targets.data += skip;
+            targets.len -= skip;
+        }
+    } else if (word_is(command, "PART")) {
+        StringView target = next_word(&line);
+        int64_t channel = parse_channel(target);
+        if (channel >= 0 && c->joined[channel]) {
+            c->joined[channel] = false;
+            sb_printf(&c->out, ":%s!mock@" SERVER_NAME " PART #chan%u\r\n", nick_of(c), (uint32_t)channel);
+        }
+    } else if (word_is(command, "LIST")) {
+        sb_printf(&c->out, ":" SERVER_NAME " 321 %s Channel :Users  Name\r\n", nick_of(c));
+        for (uint32_t i = 0; i < config.channels; i++) {
+            uint32_t users = config.users / config.channels + (i < config.users % config.channels);
+            sb_printf(&c->out, ":" SERVER_NAME " 322 %s #chan%u %u :Topic of mock channel %u\r\n", nick_of(c), i, users + 1, i);
+        }
+        sb_printf(&c->out, ":" SERVER_NAME " 323 %s :End of /LIST\r\n", nick_of(c));
+    }
+    // PRIVMSG and everything else is swallowed
+    return true;
+}
+
+// Queues the messages due since the client registered
+static void generate(Client *c, int64_t now) {
+    if (!c->registered || config.users == 0)
+        return;
+    double elapsed = (now - c->registered_at) / 1e6;
+    if (config.seconds > 0 && elapsed > config.seconds)
+        elapsed = config.seconds;
+    uint64_t due = (uint64_t)(elapsed * config.rate);
+    while (c->sent + c->held_back < due) {
+        if (c->out.len - c->written > MAX_QUEUED) {
+            c->held_back = due - c->sent;
+            return;
+        }
+        uint32_t user = random_below(config.users);
+        uint32_t channel = user % config.channels;
+        sb_printf(&c->out, ":user%u!u%u@" SERVER_NAME " PRIVMSG #chan%u :mockd:%lld",
+                  user, user, channel, (long long)now);
+        for (uint32_t n = 3 + random_below(18); n > 0; n--)
+            sb_printf(&c->out, " %s", words[random_below(ARRLEN(words))]);
+        sb_printf(&c->out, "\r\n");
+        c->sent++;
+    }
+}
+
+static void close_client(size_t i) {
+    Client *c = clients.data[i];
+    fprintf(stderr, "client %d (%s) disconnected: %llu messages sent, %llu held back\n",
+            c->fd, nick_of(c), (unsigned long long)c->sent, (unsigned long long)c->held_back);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->nick.data);
+    free(c->joined);
+    free(c);
+    clients.data[i] = da_last(clients);
+    clients.len--;
+}
+
+// false once the client is gone
+static bool read_client(Client *c) {
+    char buf[4096];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return false;
+    if (n < 0)
+        return true;
+    da_append_many(c->in, buf, (size_t)n);
+    size_t start = 0;
+    for (size_t i = 0; i < c->in.len; i++) {
+        if (c->in.data[i] != '\n')
+            continue;
+        size_t end = i;
+        if (end > start && c->in.data[end - 1] == '\r')
+            end--;
+        StringView line = {.data = c->in.data + start, .len = end - start};
+        start = i + 1;
+        // prefixes of clients are ignored
+        if (line.len > 0 && line.data[0] == ':')
+            next_word(&line);
+        if (!handle_line(c, line))
+            return false;
+    }
+    memmove(c->in.data, c->in.data + start, c->in.len - start);
+    c->in.len -= start;
+    return true;
+}
+
+static bool write_client(Client *c) {
+    while (c->written < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->written, c->out.len - c->written);
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR;
+        c->written += n;
+    }
+    c->out.len = c->written = 0;
+    return true;
+}
+
+static void accept_client(int listener) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Client *c = calloc(1, sizeof(*c));
+    assert(c != NULL);
+    c->fd = fd;
+    c->joined = calloc(config.channels, sizeof(*c->joined));
+    assert(c->joined != NULL);
+    da_append(clients, c);
+    fprintf(stderr, "client %d connected\n", fd);
+}
+
+static void report(double seconds) {
+    for (size_t i = 0; i < clients.len; i++) {
+        Client *c = clients.data[i];
+        if (!c->registered)
+            continue;
+        fprintf(stderr, "%s: %.0f msgs/s, %zu bytes queued, %llu held back\n", nick_of(c),
+                (c->sent - c->reported) / seconds, c->out.len - c->written, (unsigned long long)c->held_back);
+        c->reported = c->sent;
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p port] [-c channels] [-u users] [-r messages/s] [-d seconds]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:u:r:d:")) != -1) {
+        switch (opt) {
+        case 'p': config.port = atoi(optarg); break;
+        case 'c': config.channels = strtoul(optarg, NULL, 10); break;
+        case 'u': config.users = strtoul(optarg, NULL, 10); break;
+        case 'r': config.rate = strtod(optarg, NULL); break;
+        case 'd': config.seconds = strtod(optarg, NULL); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.channels == 0 || config.port <= 0 || config.port > 65535)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+    int yes = 1, no = 0;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    // v4 clients too
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+    struct sockaddr_in6 addr = {.sin6_family = AF_INET6, .sin6_port = htons(config.port), .sin6_addr = in6addr_any};
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        perror("bind");
+        return 1;
+    }
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    fprintf(stderr, "listening on port %d: %u channels, %u users, %.0f messages/s\n",
+            config.port, config.channels, config.users, config.rate);
+
+    struct {
+        struct pollfd *data;
+        size_t len, cap;
+    } fds = {0};
+    int64_t last_report = now_us();
+    for (;;) {
+        fds.len = 0;
+        da_append(fds, ((struct pollfd){.fd = listener, .events = POLLIN}));
+        for (size_t i = 0; i < clients.len; i++) {
+            Client *c = clients.data[i];
+            short events = POLLIN | (c->written < c->out.len ? POLLOUT : 0);
+            da_append(fds, ((struct pollfd){.fd = c->fd, .events = events}));
+        }
+        // wake up often enough to keep the rate smooth
+        if (poll(fds.data, fds.len, 1) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        if (fds.data[0].revents & POLLIN)
+            accept_client(listener);
+        int64_t now = now_us();
+        // clients.len may shrink in here, fds were taken before
+        for (size_t i = fds.len - 1; i > 0; i--) {
+            Client *c = clients.data[i - 1];
+            short revents = fds.data[i].revents;
+            bool alive = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                alive = read_client(c);
+            if (alive) {
+                generate(c, now);
+                alive = write_client(c);
+            }
+            if (!alive)
+                close_client(i - 1);
+        }
+        if (now - last_report >= 1000000) {
+            report((now - last_report) / 1e6);
+            last_report = now;
+        }
+    }
+}
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Every scrollback that holds at least one chunk is in this list, least
+// recently viewed first. The memory budget is enforced by dropping the oldest
+// chunk of the scrollback at its head.
+static struct {
+    Messages *head, *tail;
+    size_t bytes;
+    size_t max_lines;
+    size_t budget;
+} scrollback = {
+    .max_lines = 50000,
+    .budget = 256 * 1024 * 1024,
+};
+
+static size_t message_size(const Message *msg) {
+    return offsetof(Message, text) + msg->len + 1;
+}
+
+static void lru_unlink(Messages *msgs) {
+    if (msgs->lru_prev != NULL)
+        msgs->lru_prev->lru_next = msgs->lru_next;
+    else if (scrollback.head == msgs)
+        scrollback.head = msgs->lru_next;
+    if (msgs->lru_next != NULL)
+        msgs->lru_next->lru_prev = msgs->lru_prev;
+    else if (scrollback.tail == msgs)
+        scrollback.tail = msgs->lru_prev;
+    msgs->lru_prev = msgs->lru_next = NULL;
+}
+
+static void lru_push_back(Messages *msgs) {
+    msgs->lru_prev = scrollback.tail;
+    msgs->lru_next = NULL;
+    if (scrollback.tail != NULL)
+        scrollback.tail->lru_next = msgs;
+    else
+        scrollback.head = msgs;
+    scrollback.tail = msgs;
+}
+
+static void lru_push_front(Messages *msgs) {
+    msgs->lru_prev = NULL;
+    msgs->lru_next = scrollback.head;
+    if (scrollback.head != NULL)
+        scrollback.head->lru_prev = msgs;
+    else
+        scrollback.tail = msgs;
+    scrollback.head = msgs;
+}
+
+static void pop_chunk(Messages *msgs) {
+    free(msgs->chunks.data[msgs->chunk_head++]);
+    msgs->first = 0;
+    // the chunk pointers are shifted down once half of them are unused, so
+    // this stays amortized O(1) per chunk
+    if (msgs->chunk_head * 2 >= msgs->chunks.len) {
+        memmove(msgs->chunks.data, msgs->chunks.data + msgs->chunk_head,
+                (msgs->chunks.len - msgs->chunk_head) * sizeof(*msgs->chunks.data));
+        msgs->chunks.len -= msgs->chunk_head;
+        msgs->chunk_head = 0;
+    }
+    if (msgs->chunks.len == 0)
+        lru_unlink(msgs);
+}
+
+static void drop_oldest(Messages *msgs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        MessageChunk *chunk = msgs->chunks.data[msgs->chunk_head];
+        Message *msg = chunk->lines[msgs->first];
+        msgs->bytes -= message_size(msg);
+        scrollback.bytes -= message_size(msg);
+        free(msg);
+        msgs->first++;
+        msgs->len--;
+        msgs->dropped++;
+        if (msgs->first == MESSAGE_CHUNK || msgs->len == 0)
+            pop_chunk(msgs);
+    }
+}
+
+static void enforce_budget(const Messages *keep) {
+    Messages *victim = scrollback.head;
+    while (scrollback.bytes > scrollback.budget && victim != NULL) {
+        // the newest chunk of whatever was just appended to is never dropped
+        if (victim == keep && victim->chunks.len - victim->chunk_head <= 1) {
+            victim = victim->lru_next;
+            continue;
+        }
+        Messages *next = victim->lru_next;
+        drop_oldest(victim, MESSAGE_CHUNK - victim->first < victim->len
+                                ? MESSAGE_CHUNK - victim->first
+                                : victim->len);
+        if (victim->chunks.len != 0)
+            next = victim;
+        victim = next;
+    }
+}
+
+void messages_append(Messages *msgs, Message *msg) {
+    size_t pos = msgs->first + msgs->len;
+    // an empty scrollback has no chunks, so this also covers the first line
+    if (pos % MESSAGE_CHUNK == 0) {
+        if (msgs->chunks.len == msgs->chunk_head)
+            lru_push_front(msgs);
+        MessageChunk *chunk = malloc(sizeof(MessageChunk));
+        assert(chunk != NULL);
+        da_append(msgs->chunks, chunk);
+    }
+    da_last(msgs->chunks)->lines[pos % MESSAGE_CHUNK] = msg;
+    msgs->len++;
+    msgs->bytes += message_size(msg);
+    scrollback.bytes += message_size(msg);
+    if (msgs->len > scrollback.max_lines)
+        drop_oldest(msgs, msgs->len - scrollback.max_lines);
+    if (scrollback.bytes > scrollback.budget)
+        enforce_budget(msgs);
+}
+
+Message *messages_get(const Messages *msgs, size_t i) {
+    size_t pos = msgs->first + i;
+    return msgs->chunks.data[msgs->chunk_head + pos / MESSAGE_CHUNK]->lines[pos % MESSAGE_CHUNK];
+}
+
+void messages_viewed(Messages *msgs) {
+    if (msgs->chunks.len == msgs->chunk_head || scrollback.tail == msgs)
+        return;
+    lru_unlink(msgs);
+    lru_push_back(msgs);
+}
+
+void free_messages(Messages *msgs) {
+    if (msgs->len > 0)
+        drop_oldest(msgs, msgs->len);
+    lru_unlink(msgs);
+    free(msgs->chunks.data);
+    *msgs = (Messages){0};
+}
+
+void scrollback_set_limits(size_t max_lines, size_t budget) {
+    scrollback.max_lines = max_lines > 0 ? max_lines : 1;
+    scrollback.budget = budget;
+}
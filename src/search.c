@@ -0,0 +1,496 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "da.h"
+#include "irc.h"
+
+#define ARRLEN(xs) (sizeof(xs) / sizeof(*(xs)))
+
+// Trigram index over every line in the scrollback. Each trigram of the ASCII
+// lowercased text maps to the ascending list of documents (lines) containing
+// it, stored as varint encoded deltas in blocks of POSTING_BLOCK documents. A
+// query walks the lists of its trigrams block by block from the newest
+// document, so it can stop as soon as it has enough hits, and checks the
+// candidates with a substring search, which also drops lines that were evicted
+// from the scrollback since.
+//
+// A search is done a bit at a time, see search_step, so a long one does not
+// hold up a frame. Lines indexed while it runs are checked on their own and
+// their hits put in front.
+
+typedef struct {
+    IrcConnection *conn;
+    Channel *channel;
+    size_t line;
+} Document;
+
+#define POSTING_BLOCK 128
+
+typedef struct {
+    // the first document is stored as is, the rest as deltas
+    uint32_t first;
+    uint32_t offset;
+} PostingBlock;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t last;
+    struct {
+        uint8_t *data;
+        size_t len, cap;
+    } deltas;
+    struct {
+        PostingBlock *data;
+        size_t len, cap;
+    } blocks;
+} Postings;
+
+// short queries can not use the index, they only look at this many of the
+// newest lines
+#define SEARCH_SCAN_LIMIT 50000
+
+// the index is only rebuilt without the evicted lines once it has this many
+// documents
+#define SEARCH_MIN_GC 65536
+
+static struct {
+    struct {
+        Document *data;
+        size_t len, cap;
+    } docs;
+    struct {
+        Postings *data;
+        size_t len, cap;
+    } postings;
+    // open addressing table of index into postings + 1, 0 marks a free slot
+    uint32_t *slots;
+    size_t slot_count;
+    size_t next_gc;
+    // bumped by every rebuild, which renumbers the documents
+    uint32_t generation;
+} search_index = {.next_gc = SEARCH_MIN_GC};
+
+static inline uint8_t fold(uint8_t c) {
+    return 'A' <= c && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline uint32_t hash_trigram(uint32_t trigram) {
+    return trigram * 2654435761u;
+}
+
+static void insert_slot(uint32_t i) {
+    size_t mask = search_index.slot_count - 1;
+    size_t s = hash_trigram(search_index.postings.data[i].trigram) & mask;
+    while (search_index.slots[s] != 0)
+        s = (s + 1) & mask;
+    search_index.slots[s] = i + 1;
+}
+
+static Postings *find_postings(uint32_t trigram) {
+    if (search_index.slot_count == 0)
+        return NULL;
+    size_t mask = search_index.slot_count - 1;
+    for (size_t s = hash_trigram(trigram) & mask; search_index.slots[s] != 0; s = (s + 1) & mask) {
+        Postings *p = &search_index.postings.data[search_index.slots[s] - 1];
+        if (p->trigram == trigram)
+            return p;
+    }
+    return NULL;
+}
+
+static Postings *add_postings(uint32_t trigram) {
+    Postings *p = find_postings(trigram);
+    if (p != NULL)
+        return p;
+    da_append(search_index.postings, ((Postings){.trigram = trigram}));
+    // keep the load factor under 1/2
+    if (2 * search_index.postings.len > search_index.slot_count) {
+        free(search_index.slots);
+        search_index.slot_count = search_index.slot_count == 0 ? 4096 : search_index.slot_count * 2;
+        search_index.slots = calloc(search_index.slot_count, sizeof(*search_index.slots));
+        assert(search_index.slots != NULL);
+        for (size_t i = 0; i < search_index.postings.len; i++)
+            insert_slot(i);
+    } else {
+        insert_slot(search_index.postings.len - 1);
+    }
+    return &da_last(search_index.postings);
+}
+
+static void add_posting(uint32_t trigram, uint32_t doc) {
+    Postings *p = add_postings(trigram);
+    // a trigram can appear several times in one line
+    if (p->count > 0 && p->last == doc)
+        return;
+    if (p->count % POSTING_BLOCK == 0) {
+        da_append(p->blocks, ((PostingBlock){.first = doc, .offset = p->deltas.len}));
+    } else {
+        uint32_t delta = doc - p->last;
+        while (delta >= 0x80) {
+            da_append(p->deltas, (uint8_t)(delta | 0x80));
+            delta >>= 7;
+        }
+        da_append(p->deltas, (uint8_t)delta);
+    }
+    p->last = doc;
+    p->count++;
+}
+
+static inline Messages *doc_messages(const Document *doc) {
+    return doc->channel != NULL ? &doc->channel->messages : &doc->conn->system_messages;
+}
+
+// NULL if the line was evicted
+static Message *doc_message(const Document *doc) {
+    Messages *msgs = doc_messages(doc);
+    if (doc->line < msgs->dropped)
+        return NULL;
+    return messages_get(msgs, doc->line - msgs->dropped);
+}
+
+static void index_text(uint32_t doc, const char *text, size_t len) {
+    if (len < 3)
+        return;
+    uint32_t trigram = fold(text[0]) << 8 | fold(text[1]);
+    for (size_t i = 2; i < len; i++) {
+        trigram = (trigram << 8 | fold(text[i])) & 0xFFFFFF;
+        add_posting(trigram, doc);
+    }
+}
+
+static void rebuild(void) {
+    for (size_t i = 0; i < search_index.postings.len; i++) {
+        free(search_index.postings.data[i].deltas.data);
+        free(search_index.postings.data[i].blocks.data);
+    }
+    search_index.postings.len = 0;
+    memset(search_index.slots, 0, search_index.slot_count * sizeof(*search_index.slots));
+    size_t live = 0;
+    for (size_t i = 0; i < search_index.docs.len; i++) {
+        Document doc = search_index.docs.data[i];
+        Message *msg = doc_message(&doc);
+        if (msg == NULL)
+            continue;
+        search_index.docs.data[live] = doc;
+        index_text(live, msg->text, msg->len);
+        live++;
+    }
+    search_index.docs.len = live;
+    search_index.generation++;
+}
+
+void search_add(IrcConnection *conn, Channel *channel, const Message *msg) {
+    Messages *msgs = channel != NULL ? &channel->messages : &conn->system_messages;
+    if (search_index.docs.len >= search_index.next_gc) {
+        size_t live = 0;
+        for (size_t i = 0; i < search_index.docs.len; i++)
+            live += doc_message(&search_index.docs.data[i]) != NULL;
+        // only rebuild when that at least halves the index, so every line is
+        // reindexed O(1) times on average
+        if (2 * live <= search_index.docs.len)
+            rebuild();
+        search_index.next_gc = 2 * search_index.docs.len > SEARCH_MIN_GC ? 2 * search_index.docs.len : SEARCH_MIN_GC;
+    }
+    uint32_t doc = search_index.docs.len;
+    da_append(search_index.docs, ((Document){.conn = conn, .channel = channel, .line = msgs->dropped + msgs->len - 1}));
+    index_text(doc, msg->text, msg->len);
+}
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SEARCH_SIMD
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+
+static inline u8x16 fold16(u8x16 v) {
+    u8x16 upper = (u8x16)((v >= 'A') & (v <= 'Z'));
+    return v + (upper & 32);
+}
+#endif
+
+// Case insensitive substring search, `needle` has to be lowercased already
+static bool contains(const char *hay, size_t hay_len, StringView needle) {
+    if (needle.len == 0)
+        return true;
+    if (hay_len < needle.len)
+        return false;
+    size_t last = hay_len - needle.len;
+    size_t i = 0;
+#ifdef SEARCH_SIMD
+    // compare the first and the last byte of the needle at 16 positions at
+    // once and only check the rest where both of them match
+    u8x16 first = {0}, final = {0};
+    first += (uint8_t)needle.data[0];
+    final += (uint8_t)needle.data[needle.len - 1];
+    for (; i + 16 <= last + 1; i += 16) {
+        u8x16 a, b;
+        memcpy(&a, hay + i, 16);
+        memcpy(&b, hay + i + needle.len - 1, 16);
+        u8x16 eq = (u8x16)(fold16(a) == first) & (u8x16)(fold16(b) == final);
+        uint64_t mask[2];
+        memcpy(mask, &eq, 16);
+        for (int half = 0; half < 2; half++) {
+            while (mask[half] != 0) {
+                size_t at = i + half * 8 + __builtin_ctzll(mask[half]) / 8;
+                mask[half] &= ~(0xFFull << (__builtin_ctzll(mask[half]) / 8 * 8));
+                size_t j = 1;
+                while (j + 1 < needle.len && fold(hay[at + j]) == (uint8_t)needle.data[j])
+                    j++;
+                if (j + 1 >= needle.len)
+                    return true;
+            }
+        }
+    }
+#endif
+    for (; i <= last; i++) {
+        size_t j = 0;
+        while (j < needle.len && fold(hay[i + j]) == (uint8_t)needle.data[j])
+            j++;
+        if (j == needle.len)
+            return true;
+    }
+    return false;
+}
+
+static inline uint32_t next_delta(const uint8_t **p) {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *(*p)++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return value;
+    }
+}
+
+// Walks a posting list from the newest document to the oldest
+typedef struct {
+    // index into search_index.postings, which moves as it grows
+    uint32_t postings;
+    // the decoded block, -1 once the list is exhausted
+    ptrdiff_t block;
+    uint32_t docs[POSTING_BLOCK];
+    uint32_t len;
+} Cursor;
+
+static inline const Postings *cursor_postings(const Cursor *c) {
+    return &search_index.postings.data[c->postings];
+}
+
+static void decode_block(Cursor *c) {
+    const Postings *p = cursor_postings(c);
+    const PostingBlock *block = &p->blocks.data[c->block];
+    const uint8_t *deltas = p->deltas.data + block->offset;
+    c->len = (size_t)c->block + 1 < p->blocks.len ? POSTING_BLOCK : p->count - c->block * POSTING_BLOCK;
+    c->docs[0] = block->first;
+    for (uint32_t i = 1; i < c->len; i++)
+        c->docs[i] = c->docs[i - 1] + next_delta(&deltas);
+}
+
+// Moves back to the block that would contain doc, false once every document
+// left is newer than doc
+static bool cursor_seek(Cursor *c, uint32_t doc) {
+    ptrdiff_t block = c->block;
+    while (block >= 0 && cursor_postings(c)->blocks.data[block].first > doc)
+        block--;
+    if (block < 0)
+        return false;
+    if (block != c->block) {
+        c->block = block;
+        decode_block(c);
+    }
+    return true;
+}
+
+static bool cursor_has(const Cursor *c, uint32_t doc) {
+    uint32_t lo = 0, hi = c->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (c->docs[mid] < doc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < c->len && c->docs[lo] == doc;
+}
+
+static bool check(uint32_t doc, StringView needle, SearchHits *hits) {
+    const Document *d = &search_index.docs.data[doc];
+    Message *msg = doc_message(d);
+    if (msg == NULL || !contains(msg->text, msg->len, needle))
+        return false;
+    da_append(*hits, ((SearchHit){.conn = d->conn, .channel = d->channel, .line = d->line}));
+    return true;
+}
+
+static int compare_count(const void *a, const void *b) {
+    uint32_t ca = cursor_postings(*(const Cursor *const *)a)->count;
+    uint32_t cb = cursor_postings(*(const Cursor *const *)b)->count;
+    return ca < cb ? -1 : ca > cb;
+}
+
+// The search in progress
+static struct {
+    // the lowercased query
+    StringBuilder needle;
+    size_t max;
+    // no more hits from walking the index
+    bool done;
+    // search_index.generation the walk belongs to
+    uint32_t generation;
+    // documents after this one came in since and are caught up with on their
+    // own
+    size_t docs_end;
+    // short queries count down from doc to stop
+    size_t doc, stop;
+    // longer ones walk the lists of their trigrams, the shortest one first,
+    // at index next of its decoded block
+    Cursor cursors[32];
+    Cursor *lists[32];
+    size_t list_count;
+    uint32_t next;
+    // hits among the documents that were caught up with
+    SearchHits fresh;
+} running;
+
+static void start_walk(void) {
+    running.done = false;
+    running.generation = search_index.generation;
+    running.docs_end = search_index.docs.len;
+    running.list_count = 0;
+    StringView needle = {.data = running.needle.data, .len = running.needle.len};
+    if (needle.len == 0 || running.max == 0) {
+        running.done = true;
+        return;
+    }
+
+    if (needle.len < 3) {
+        running.doc = search_index.docs.len;
+        running.stop = search_index.docs.len > SEARCH_SCAN_LIMIT ? search_index.docs.len - SEARCH_SCAN_LIMIT : 0;
+        return;
+    }
+
+    for (size_t i = 0; i + 2 < needle.len && running.list_count < ARRLEN(running.cursors); i++) {
+        uint32_t trigram = (uint8_t)needle.data[i] << 16 | (uint8_t)needle.data[i + 1] << 8 | (uint8_t)needle.data[i + 2];
+        Postings *p = find_postings(trigram);
+        if (p == NULL) {
+            running.done = true;
+            return;
+        }
+        uint32_t index = p - search_index.postings.data;
+        bool seen = false;
+        for (size_t l = 0; l < running.list_count; l++)
+            seen = seen || running.lists[l]->postings == index;
+        if (seen)
+            continue;
+        Cursor *c = &running.cursors[running.list_count];
+        c->postings = index;
+        c->block = p->blocks.len - 1;
+        decode_block(c);
+        running.lists[running.list_count++] = c;
+    }
+    // the shortest list gives the candidates, the others only have to be
+    // looked up in
+    qsort(running.lists, running.list_count, sizeof(*running.lists), compare_count);
+    running.next = running.lists[0]->len;
+}
+
+// Looks at up to *budget more documents of the index as it was when the
+// search started
+static void walk(SearchHits *hits, size_t *budget) {
+    StringView needle = {.data = running.needle.data, .len = running.needle.len};
+    if (needle.len < 3) {
+        for (; running.doc > running.stop && hits->len < running.max && *budget > 0; running.doc--, (*budget)--)
+            check(running.doc - 1, needle, hits);
+        running.done = running.doc == running.stop || hits->len == running.max;
+        return;
+    }
+
+    Cursor *shortest = running.lists[0];
+    while (*budget > 0) {
+        if (running.next == 0) {
+            if (shortest->block == 0) {
+                running.done = true;
+                return;
+            }
+            shortest->block--;
+            decode_block(shortest);
+            running.next = shortest->len;
+        }
+        uint32_t doc = shortest->docs[--running.next];
+        (*budget)--;
+        bool found = true;
+        for (size_t l = 1; l < running.list_count && found; l++) {
+            if (!cursor_seek(running.lists[l], doc)) {
+                running.done = true;
+                return;
+            }
+            found = cursor_has(running.lists[l], doc);
+        }
+        if (found && check(doc, needle, hits) && hits->len == running.max) {
+            running.done = true;
+            return;
+        }
+    }
+}
+
+// Checks up to *budget of the documents indexed since the search started,
+// oldest first, and puts their hits in front
+static void catch_up(SearchHits *hits, size_t *budget) {
+    size_t end = search_index.docs.len - running.docs_end > *budget ? running.docs_end + *budget : search_index.docs.len;
+    if (end == running.docs_end)
+        return;
+    StringView needle = {.data = running.needle.data, .len = running.needle.len};
+    running.fresh.len = 0;
+    for (size_t doc = end; doc > running.docs_end && running.fresh.len < running.max; doc--)
+        check(doc - 1, needle, &running.fresh);
+    *budget -= end - running.docs_end;
+    running.docs_end = end;
+    if (running.fresh.len == 0)
+        return;
+    // the oldest hits fall off the end, the walk could only find older ones
+    size_t keep = hits->len < running.max - running.fresh.len ? hits->len : running.max - running.fresh.len;
+    da_reserve(*hits, running.fresh.len + keep);
+    memmove(hits->data + running.fresh.len, hits->data, keep * sizeof(*hits->data));
+    memcpy(hits->data, running.fresh.data, running.fresh.len * sizeof(*hits->data));
+    hits->len = running.fresh.len + keep;
+    if (hits->len == running.max)
+        running.done = true;
+}
+
+void search_start(StringView query, SearchHits *hits, size_t max) {
+    hits->len = 0;
+    running.needle.len = 0;
+    for (size_t i = 0; i < query.len; i++)
+        da_append(running.needle, (char)fold(query.data[i]));
+    running.max = max;
+    start_walk();
+}
+
+bool search_step(SearchHits *hits, size_t budget) {
+    if (running.needle.len == 0 || running.max == 0)
+        return true;
+    if (running.generation != search_index.generation) {
+        // the index was rebuilt, the documents found so far have other
+        // numbers now
+        hits->len = 0;
+        start_walk();
+    }
+    catch_up(hits, &budget);
+    if (!running.done)
+        walk(hits, &budget);
+    return running.done && running.docs_end == search_index.docs.len;
+}
+
+void search_free(void) {
+    for (size_t i = 0; i < search_index.postings.len; i++) {
+        free(search_index.postings.data[i].deltas.data);
+        free(search_index.postings.data[i].blocks.data);
+    }
+    free(search_index.postings.data);
+    free(search_index.docs.data);
+    free(search_index.slots);
+    memset(&search_index, 0, sizeof(search_index));
+    free(running.needle.data);
+    free(running.fresh.data);
+    memset(&running, 0, sizeof(running));
+    search_index.next_gc = SEARCH_MIN_GC;
+}
@@ -0,0 +1,46 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Lock-free single-producer/single-consumer ring. The queue is any struct with
+// a fixed size `data` array (its length has to be a power of two) and atomic
+// `head`/`tail` counters:
+//
+//     struct {
+//         Item data[1024];
+//         atomic_size_t head, tail;
+//     } queue;
+//
+// Only the producer may call spsc_full/spsc_free/spsc_push and only the
+// consumer may call spsc_empty/spsc_front/spsc_pop. Pushing to a full queue is
+// a bug, producers check for room first.
+
+#define spsc_cap(q) (sizeof((q).data) / sizeof(*(q).data))
+
+#define spsc_full(q)                                                           \
+    (atomic_load_explicit(&(q).tail, memory_order_relaxed) -                   \
+         atomic_load_explicit(&(q).head, memory_order_acquire) ==              \
+     spsc_cap(q))
+
+// Slots the producer can push to without checking again
+#define spsc_free(q)                                                           \
+    (spsc_cap(q) - (atomic_load_explicit(&(q).tail, memory_order_relaxed) -   \
+                    atomic_load_explicit(&(q).head, memory_order_acquire)))
+
+#define spsc_empty(q)                                                          \
+    (atomic_load_explicit(&(q).head, memory_order_relaxed) ==                  \
+     atomic_load_explicit(&(q).tail, memory_order_acquire))
+
+#define spsc_push(q, x)                                                        \
+    do {                                                                       \
+        assert(!spsc_full(q));                                                 \
+        size_t tail_ = atomic_load_explicit(&(q).tail, memory_order_relaxed);  \
+        (q).data[tail_ & (spsc_cap(q) - 1)] = (x);                             \
+        atomic_store_explicit(&(q).tail, tail_ + 1, memory_order_release);     \
+    } while (0)
+
+#define spsc_front(q)                                                          \
+    (q).data[atomic_load_explicit(&(q).head, memory_order_relaxed) &           \
+             (spsc_cap(q) - 1)]
+
+#define spsc_pop(q) atomic_fetch_add_explicit(&(q).head, 1, memory_order_release)
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "da.h"
+#include "irc.h"
+
+// Per-frame timings for the performance overlay, kept in fixed rings so that
+// recording costs the same whether anybody looks at them or not. With
+// TOKI_STATS=<path> a summary is also appended to that file as one JSON
+// object per line every second.
+
+// a few seconds worth of frames at 60 to 144 Hz
+#define STATS_FRAMES 512
+// lines parsed, sampled once a second
+#define PARSE_SAMPLES 8
+
+static struct {
+    FrameStats frames[STATS_FRAMES];
+    // frames recorded so far, frames[recorded % STATS_FRAMES] is the next one
+    size_t recorded;
+    struct {
+        int64_t at_ms;
+        size_t lines;
+    } parsed[PARSE_SAMPLES];
+    size_t sampled;
+    // -1 until TOKI_STATS was looked at
+    int dump_enabled;
+    FILE *dump;
+    int64_t dumped_at_ms;
+} stats = {.dump_enabled = -1};
+
+double stats_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+void stats_summary(StatsSummary *summary) {
+    *summary = (StatsSummary){0};
+    size_t n = stats.recorded < STATS_FRAMES ? stats.recorded : STATS_FRAMES;
+    summary->frames = n;
+    if (n > 0) {
+        float times[STATS_FRAMES];
+        for (size_t i = 0; i < n; i++) {
+            const FrameStats *f = &stats.frames[i];
+            times[i] = f->frame_ms;
+            summary->layout_ms += f->layout_ms;
+            summary->render_ms += f->render_ms;
+            summary->process_ms += f->process_ms;
+            summary->quads += f->quads;
+            summary->glyphs += f->glyphs;
+            summary->draw_calls += f->draw_calls;
+            summary->uploaded_glyphs += f->uploaded_glyphs;
+        }
+        qsort(times, n, sizeof(*times), compare_floats);
+        summary->frame_p50 = times[(n - 1) * 50 / 100];
+        summary->frame_p90 = times[(n - 1) * 90 / 100];
+        summary->frame_p99 = times[(n - 1) * 99 / 100];
+        summary->frame_max = times[n - 1];
+        summary->layout_ms /= n;
+        summary->render_ms /= n;
+        summary->process_ms /= n;
+        summary->quads /= n;
+        summary->glyphs /= n;
+        summary->draw_calls /= n;
+        summary->uploaded_glyphs /= n;
+    }
+    if (stats.sampled >= 2) {
+        size_t newest = (stats.sampled - 1) % PARSE_SAMPLES;
+        size_t oldest = stats.sampled > PARSE_SAMPLES ? stats.sampled % PARSE_SAMPLES : 0;
+        int64_t ms = stats.parsed[newest].at_ms - stats.parsed[oldest].at_ms;
+        if (ms > 0)
+            summary->lines_per_second = (stats.parsed[newest].lines - stats.parsed[oldest].lines) * 1000.0 / ms;
+    }
+}
+
+static void dump(int64_t now) {
+    StatsSummary s;
+    stats_summary(&s);
+    fprintf(stats.dump,
+            "{\"time_ms\":%lld,\"frames\":%zu,\"frame_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+            "\"layout_ms\":%.3f,\"render_ms\":%.3f,\"process_ms\":%.3f,"
+            "\"quads\":%.1f,\"glyphs\":%.1f,\"draw_calls\":%.1f,\"uploaded_glyphs\":%.1f,"
+            "\"lines_per_second\":%.1f,\"lag_ms\":[",
+            (long long)now, s.frames, s.frame_p50, s.frame_p90, s.frame_p99, s.frame_max,
+            s.layout_ms, s.render_ms, s.process_ms, s.quads, s.glyphs, s.draw_calls, s.uploaded_glyphs,
+            s.lines_per_second);
+    for (size_t i = 0; i < connections.len; i++)
+        fprintf(stats.dump, "%s%lld", i > 0 ? "," : "", (long long)connections.data[i]->lag_ms);
+    fprintf(stats.dump, "]}\n");
+    fflush(stats.dump);
+}
+
+void stats_frame(const FrameStats *frame) {
+    stats.frames[stats.recorded % STATS_FRAMES] = *frame;
+    stats.recorded++;
+    int64_t now = (int64_t)stats_now_ms();
+    size_t last = (stats.sampled + PARSE_SAMPLES - 1) % PARSE_SAMPLES;
+    if (stats.sampled == 0 || now - stats.parsed[last].at_ms >= 1000) {
+        stats.parsed[stats.sampled % PARSE_SAMPLES].at_ms = now;
+        stats.parsed[stats.sampled % PARSE_SAMPLES].lines = irc_lines_parsed();
+        stats.sampled++;
+    }
+    if (stats.dump_enabled < 0) {
+        const char *path = getenv("TOKI_STATS");
+        stats.dump = path != NULL && *path != '\0' ? fopen(path, "a") : NULL;
+        if (path != NULL && *path != '\0' && stats.dump == NULL)
+            perror(path);
+        stats.dump_enabled = stats.dump != NULL;
+        stats.dumped_at_ms = now;
+    }
+    if (stats.dump_enabled && now - stats.dumped_at_ms >= 1000) {
+        dump(now);
+        stats.dumped_at_ms = now;
+    }
+}